@@ -15,8 +15,27 @@
  * https://www.tutorialspoint.com/cplusplus-program-to-implement-self-balancing-binary-search-tree
  */
 
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <fcntl.h>
 #include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -25,16 +44,243 @@ struct tree_node {
     int value;
     struct tree_node *left;
     struct tree_node *right;
+    struct tree_node *parent;   // not kept up to date for the root
+    int size;       // number of values in the subtree, without tombstones
+    int rank;       // balance information, owned by the balancing policy
+    bool deleted;   // tombstone left by a lazy delete
+    int epoch;      // compaction epoch in which the node was placed
+    int settled;    // lowest epoch within the node's subtree
 } *root;
 
 // Type declaration of node, to ease the implementation
 typedef struct tree_node node;
 
+// Number of nodes of the first slab allocated by avl_tree.  Each next slab
+// is at least twice as large as the previous one, so a small tree stays
+// small and a large one still takes few allocations.
+const int NODE_SLAB = 16;
+
+// Number of lookups advanced together by the batched lookup methods
+const int LOOKUP_LANES = 16;
+
+// State of one of the lookups advanced by avl_tree::interleave
+struct lookup_lane {
+    node *current;
+    int index;
+    int key;
+    int acc;
+};
+
+// A registered percentile: the value with the given rank is kept up to
+// date as the tree changes, so reading it is O(1)
+struct percentile_tracker {
+    int permille;
+    int rank;       // 0 when the tree is empty
+    int value;
+};
+
+// A saved path from the root to the last node touched through it, with the
+// range of values each node of the path can hold.  Searches and inserts
+// through a finger start from that node and climb only as far as needed.
+struct tree_finger {
+    vector<node *> path;
+    vector<long> low;       // exclusive bounds of the subtree of path[i]
+    vector<long> high;
+    long version;           // avl_tree::version the path was saved at
+
+    tree_finger() : version(-1) {}
+};
+
+// Number of values per block in a compressed snapshot
+const int SNAPSHOT_BLOCK = 128;
+
+// Magic number at the start and at the end of a snapshot file
+const char SNAPSHOT_MAGIC[4] = {'A', 'V', 'L', 'I'};
+
+// Header of each block of a compressed snapshot.  The first value of the
+// block is min; every other one is stored as the difference with the
+// previous value, encoded as a varint.  min and max let a reader skip the
+// block without decoding it.
+struct snapshot_block {
+    int count;
+    int min;
+    int max;
+    int bytes;
+};
+
+// Entry of the index at the end of a snapshot: the header of a block, and
+// where the block starts in the file
+struct snapshot_entry {
+    snapshot_block block;
+    long offset;
+};
+
+// Last bytes of a snapshot: where its index starts, and its number of blocks
+struct snapshot_trailer {
+    long index;
+    int blocks;
+    char magic[4];
+};
+
+// Buffers sorted values and writes them to a file as compressed blocks.  A
+// snapshot is a magic number and the number of values, the blocks, then
+// the index of the blocks, aligned for snapshot_entry, and a trailer.  The
+// blocks hold consecutive runs of the sorted values, so each one is the
+// content of a subtree; the index is what a reader needs to find one
+// without reading the others.
+struct snapshot_writer {
+    FILE *file;
+    int values[SNAPSHOT_BLOCK];
+    int count;
+    long offset;                    // bytes written so far
+    vector<snapshot_entry> index;
+    bool failed;
+
+    explicit snapshot_writer(FILE *file) : file(file), count(0), offset(0), failed(false) {}
+    void begin(int);
+    void add(int);
+    void flush();
+    void finish();
+};
+
+// Decodes the values of a compressed snapshot, one at a time, checking
+// that every block is well formed: failed is set as soon as one isn't
+struct snapshot_reader {
+    const unsigned char *pos;
+    const unsigned char *end;
+    const unsigned char *blockEnd;
+    snapshot_block block;
+    int left;
+    long last;              // last value decoded, or LONG_MIN before any
+    bool failed;
+
+    snapshot_reader(const unsigned char *pos, const unsigned char *end)
+            : pos(pos), end(end), blockEnd(pos), left(0), last(LONG_MIN), failed(false) {}
+    int next();
+};
+
+// A snapshot file mapped into memory.  Opening it checks the header, the
+// trailer and the index, which is O(number of blocks) and doesn't touch the
+// blocks themselves; each block is checked against its index entry when it
+// is decoded.
+struct snapshot_map {
+    const unsigned char *data;
+    size_t length;
+    int count;
+    const snapshot_entry *index;
+    int blocks;
+
+    snapshot_map() : data(nullptr), length(0), count(0), index(nullptr), blocks(0) {}
+    snapshot_map(const snapshot_map &) = delete;
+    snapshot_map &operator=(const snapshot_map &) = delete;
+    ~snapshot_map() {
+        close();
+    }
+    void open(const char *, int);
+    bool decode(int, int *) const;
+    void close();
+};
+
+// A checkpoint child that hasn't been collected yet, the snapshot it
+// writes and the temporary file it writes it to.  stale is set once a
+// newer checkpoint of the same path has been renamed over it.
+struct pending_checkpoint {
+    pid_t pid;
+    string path;
+    string temp;
+    bool stale;
+};
+
+// Writes pending against a sorted set of values, at most one per value and
+// sorted by value: +1 for a value missing from the set that gets inserted,
+// -1 for a value of the set that gets deleted.  The deletes are also kept
+// in a sorted list of their own, so the writes below a value add up to the
+// number of them below it minus twice the number of deletes, two binary
+// searches with nothing to rebuild after a write.
+struct sorted_writes {
+    vector<int> keys;
+    vector<int> deltas;
+    vector<int> deletes;
+    int net;                // sum of the deltas
+
+    sorted_writes() : net(0) {}
+    template <typename Contains>
+    void record(int, bool, Contains);
+    int below(int);
+    template <typename Rank>
+    bool select(int, Rank, int &);
+    void clear();
+};
+
+// Hands out the values of a sorted array, for avl_tree::buildFromSorted
+struct array_source {
+    const int *next_value;
+
+    int next() {
+        return *next_value++;
+    }
+};
+
+// Hands out existing nodes in inorder, for avl_tree::buildFromSorted to
+// relink instead of allocating new ones
+struct node_source {
+    node **next_node;
+};
+
 // Declaration of the AVL Tree class.  This class implements all the methods
 // needed for a AVL sBBST.
 class avl_tree {
     int elements;
+    vector<node *> slabs;   // every block of nodes owned by the tree
+    size_t liveSlab;        // first slab that is not being evacuated
+    int slabUsed;
+    int slabCapacity;
+    node *freeNodes;
+    int epoch;
+    vector<node *> spine;   // path from the root to the maximum, if known
+    int maxKey;
+    bool maxKnown;
+    int minTracker;         // trackers behind peekMin and peekMax, or -1
+    node *lastInserted;     // node holding the value of the last insert
+    int maxTracker;
+    long version;           // bumped by every change to the tree's shape
+    int tombstones;
+    int tombstoneLimit;     // percentage of tombstones that triggers a rebuild
+    vector<pending_checkpoint> checkpoints;
+    int failedCheckpoints;
+    void waitCheckpoint(size_t, bool);
     int kthSmallest(node *, int, int &);
+    node *relocate(node *, int &);
+    template <typename Source>
+    node *buildLevel(Source &, int, int, int);
+    template <typename Source>
+    node *takeNode(Source &);
+    node *takeNode(node_source &);
+    template <typename Step>
+    void interleave(node *, const int *, int, Step);
+    vector<percentile_tracker> trackers;
+    node *insertValue(node *, int, int &);
+    node *deleteValue(node *, int, int &);
+    node *deleteKth(node *, int, int &);
+    node *unlink(node *);
+    node *settleDelete(node *, int);
+    int copyOut(node *, int, int, int *, int, bool);
+    int maxValue(node *);
+    node *appendMax(node *, int);
+    void fingerClimb(node *, tree_finger &, int);
+    void fingerDescend(tree_finger &, int);
+    node *markDeleted(node *, int, int &);
+    node *purge(node *);
+    void sweep(node *, vector<node *> &);
+    void split(node *, int, node *&, node *&, node *&);
+    node *unlinkMin(node *, node *&);
+    node *subtract(node *, const int *, int);
+    int discard(node *);
+    void trackInsert(node *, int);
+    void trackDelete(node *, int);
+    void shiftTracker(node *, percentile_tracker &);
+    void selectSplit(node *, const int *, int, int, int *);
+    void rankSplit(node *, const int *, int, int, int *);
 public:
     int height(node *);
     int difference(node *);
@@ -52,19 +298,535 @@ public:
     node *insert(node *, int);
     node *deleteNode(node *, int);
     node *minValueNode(node *);
+    node *firstNode(node *);
+    node *lastNode(node *);
+    node *nextNode(node *, node *);
+    node *prevNode(node *, node *);
     node *search(node *, int);
     void show(node *, int);
     void inorder(node *);
     void preorder(node *);
     void postorder(node *);
+    int bottomK(node *, int, int *);
+    int topK(node *, int, int *);
+    int rangeValues(node *, int, int, int *, int);
+    void serialize(node *, snapshot_writer &);
+    pid_t checkpoint(node *, const char *);
+    int reapCheckpoints(bool);
+    void awaitCheckpoint(const char *);
+    template <typename Source>
+    node *buildFromSorted(Source &, int);
+    template <typename Source>
+    node *assign(node *, Source &, int);
+    node *load(node *, const char *);
+    void destroy(node *);
+    void update(node *);
+    node *newNode(int);
+    void freeNode(node *);
+    node *compact(node *, int);
+    bool compacting();
+    int size(node *);
+    void searchBatch(node *, const int *, int, node **);
+    void rankBatch(node *, const int *, int, int *);
+    void selectBatch(node *, const int *, int, int *);
+    void selectMany(node *, const int *, int, int *);
+    void rankMany(node *, const int *, int, int *);
+    int selectMerged(node *, const int *, const int *, int, int);
+    void bucketCounts(node *, const int *, int, int *);
+    node *selectNode(node *, int);
+    node *nextValueNode(node *, int);
+    node *prevValueNode(node *, int);
+    int trackPercentile(node *, int);
+    int percentile(int);
+    void resetTrackers(node *);
+    node *deleteBatch(node *, const int *, int);
+    node *fingerSearch(node *, tree_finger &, int);
+    node *fingerInsert(node *, tree_finger &, int);
+    int alive(node *);
+    node *setLazyDelete(node *, int);
+    node *eraseRange(node *, int, int);
+    node *insertRank(node *, int, int &);
+    node *eraseRank(node *, int, int &);
+    node *eraseKth(node *, int, int &);
+    node *popMin(node *, int &);
+    node *popMax(node *, int &);
+    int peekMin(node *);
+    int peekMax(node *);
+    node *insertHandle(node *, int, node *&);
+    node *eraseHandle(node *, node *);
 
     // Constructor
     avl_tree() {
         root = nullptr;
         this->elements = 0;
+        this->liveSlab = 0;
+        this->slabUsed = 0;
+        this->slabCapacity = 0;
+        this->freeNodes = nullptr;
+        this->epoch = 0;
+        this->maxKey = 0;
+        this->maxKnown = false;
+        this->minTracker = -1;
+        this->maxTracker = -1;
+        this->lastInserted = nullptr;
+        this->version = 0;
+        this->tombstones = 0;
+        this->tombstoneLimit = 0;
+        this->failedCheckpoints = 0;
+    }
+
+    // Destructor
+    ~avl_tree() {
+        for (node *slab : slabs) {
+            delete[] slab;
+        }
+    }
+};
+
+// The rebalancing done by avl_tree is a compile-time policy, picked per
+// deployment by defining BBST_RED_BLACK, BBST_WAVL or BBST_TREAP (AVL is the
+// default).  Every policy keeps its balance information in node::rank and
+// provides the same static hooks:
+//
+//   init(node *)                  sets up a new leaf
+//   update(node *)                recomputes rank after the children changed
+//   balance(avl_tree &, node *)   restores the invariant at a node after one
+//                                 of its subtrees changed by a single insert
+//                                 or delete, returning the new subtree root
+//   finish(node *)                fixes up the root after a whole operation
+//   build(node *, int, int)       sets up a node of a tree made by
+//                                 avl_tree::buildFromSorted, given its depth
+//                                 and the number of complete levels
+//   join(avl_tree &, node *, node *, node *)
+//                                 joins two trees, all of whose values are
+//                                 smaller and greater than the middle node's,
+//                                 in time proportional to the difference of
+//                                 their heights; the result's root may need
+//                                 finish()
+
+// AVL: rank is the height of the subtree, and the heights of the children of
+// every node differ by at most one.
+struct avl_balance {
+    static int height(node *tree) {
+        return tree == nullptr ? 0 : tree->rank;
+    }
+
+    static int difference(node *tree) {
+        return height(tree->left) - height(tree->right);
+    }
+
+    static void init(node *tree) {
+        tree->rank = 1;
+    }
+
+    static void update(node *tree) {
+        tree->rank = 1 + max(height(tree->left), height(tree->right));
+    }
+
+    static node *balance(avl_tree &tree, node *parent) {
+        int balance_factor = difference(parent);
+        if (balance_factor > 1) {
+            if (difference(parent->left) >= 0) {
+                parent = tree.ll_rotation(parent);
+            } else {
+                parent = tree.lr_rotation(parent);
+            }
+        } else if (balance_factor < -1) {
+            if (difference(parent->right) > 0) {
+                parent = tree.rl_rotation(parent);
+            } else {
+                parent = tree.rr_rotation(parent);
+            }
+        }
+        return parent;
+    }
+
+    static node *finish(node *root) {
+        return root;
+    }
+
+    static void build(node *, int, int) {}
+
+    static node *join(avl_tree &tree, node *left, node *middle, node *right) {
+        if (height(left) > height(right) + 1) {
+            left->right = join(tree, left->right, middle, right);
+            tree.update(left);
+            return balance(tree, left);
+        } else if (height(right) > height(left) + 1) {
+            right->left = join(tree, left, middle, right->left);
+            tree.update(right);
+            return balance(tree, right);
+        }
+        middle->left = left;
+        middle->right = right;
+        tree.update(middle);
+        return middle;
+    }
+};
+
+// Red-black: rank holds the black height of the subtree (black nodes on the
+// way down to a leaf, counting the node itself) times two, plus one if the
+// node is red.  Fixes are done bottom-up, one node at a time: a red child
+// with a red child is fixed at its grandparent, and a subtree whose black
+// height dropped after a delete is fixed at its parent.
+struct red_black_balance {
+    static bool red(node *tree) {
+        return tree != nullptr && (tree->rank & 1);
+    }
+
+    static int black_height(node *tree) {
+        return tree == nullptr ? 0 : tree->rank >> 1;
+    }
+
+    static void paint(node *tree, bool is_red) {
+        int below = max(black_height(tree->left), black_height(tree->right));
+        tree->rank = is_red ? below * 2 + 1 : (below + 1) * 2;
+    }
+
+    static void init(node *tree) {
+        tree->rank = 1;
+    }
+
+    static void update(node *tree) {
+        paint(tree, red(tree));
+    }
+
+    // Fixes a red child with a red child of its own, below parent
+    static node *fix_red(avl_tree &tree, node *parent) {
+        node *left = parent->left;
+        node *right = parent->right;
+        bool left_double = red(left) && (red(left->left) || red(left->right));
+        bool right_double = red(right) && (red(right->left) || red(right->right));
+        if (!left_double && !right_double) {
+            return parent;
+        }
+        if (red(left) && red(right)) {
+            paint(left, false);
+            paint(right, false);
+            paint(parent, true);
+            return parent;
+        }
+        if (left_double) {
+            if (red(left->right)) {
+                parent->left = tree.rr_rotation(left);
+            }
+            parent = tree.ll_rotation(parent);
+            paint(parent->right, true);
+        } else {
+            if (red(right->left)) {
+                parent->right = tree.ll_rotation(right);
+            }
+            parent = tree.rr_rotation(parent);
+            paint(parent->left, true);
+        }
+        paint(parent, false);
+        return parent;
+    }
+
+    // Fixes a left subtree whose black height is one less than the right one
+    static node *fix_left(avl_tree &tree, node *parent) {
+        node *sibling = parent->right;
+        if (red(parent->left)) {
+            paint(parent->left, false);
+        } else if (red(sibling)) {
+            parent = tree.rr_rotation(parent);
+            paint(parent->left, true);
+            paint(parent, false);
+            parent->left = fix_left(tree, parent->left);
+            update(parent);
+            tree.update(parent);
+        } else if (!red(sibling->left) && !red(sibling->right)) {
+            paint(sibling, true);
+            if (red(parent)) {
+                paint(parent, false);
+            }
+        } else {
+            bool was_red = red(parent);
+            if (!red(sibling->right)) {
+                parent->right = tree.ll_rotation(sibling);
+            }
+            parent = tree.rr_rotation(parent);
+            paint(parent->left, false);
+            paint(parent->right, false);
+            paint(parent, was_red);
+        }
+        update(parent);
+        return parent;
+    }
+
+    // Mirror of fix_left
+    static node *fix_right(avl_tree &tree, node *parent) {
+        node *sibling = parent->left;
+        if (red(parent->right)) {
+            paint(parent->right, false);
+        } else if (red(sibling)) {
+            parent = tree.ll_rotation(parent);
+            paint(parent->right, true);
+            paint(parent, false);
+            parent->right = fix_right(tree, parent->right);
+            update(parent);
+            tree.update(parent);
+        } else if (!red(sibling->left) && !red(sibling->right)) {
+            paint(sibling, true);
+            if (red(parent)) {
+                paint(parent, false);
+            }
+        } else {
+            bool was_red = red(parent);
+            if (!red(sibling->left)) {
+                parent->left = tree.rr_rotation(sibling);
+            }
+            parent = tree.ll_rotation(parent);
+            paint(parent->left, false);
+            paint(parent->right, false);
+            paint(parent, was_red);
+        }
+        update(parent);
+        return parent;
+    }
+
+    static node *balance(avl_tree &tree, node *parent) {
+        int left = black_height(parent->left);
+        int right = black_height(parent->right);
+        if (left < right) {
+            return fix_left(tree, parent);
+        } else if (left > right) {
+            return fix_right(tree, parent);
+        }
+        return fix_red(tree, parent);
+    }
+
+    static node *finish(node *root) {
+        if (red(root)) {
+            paint(root, false);
+        }
+        return root;
+    }
+
+    static void build(node *tree, int depth, int full) {
+        // Only the last, incomplete level is red
+        paint(tree, depth >= full);
+    }
+
+    // Hangs the middle node, painted red, where the black heights match
+    static node *join_red(avl_tree &tree, node *left, node *middle, node *right) {
+        int left_height = black_height(left);
+        int right_height = black_height(right);
+        if (left_height > right_height || (left_height == right_height && red(left))) {
+            left->right = join_red(tree, left->right, middle, right);
+            tree.update(left);
+            return balance(tree, left);
+        } else if (right_height > left_height || red(right)) {
+            right->left = join_red(tree, left, middle, right->left);
+            tree.update(right);
+            return balance(tree, right);
+        }
+        middle->left = left;
+        middle->right = right;
+        paint(middle, true);
+        tree.update(middle);
+        return middle;
+    }
+
+    static node *join(avl_tree &tree, node *left, node *middle, node *right) {
+        return join_red(tree, finish(left), middle, finish(right));
+    }
+};
+
+// WAVL (weak AVL): every node has an integer rank, missing children have
+// rank -1, leaves have rank 0, and the rank difference between a node and
+// each of its children is 1 or 2.  Inserts are rebalanced like AVL, while
+// deletes need at most two rotations in total.
+struct wavl_balance {
+    static int rank(node *tree) {
+        return tree == nullptr ? -1 : tree->rank;
+    }
+
+    static void init(node *tree) {
+        tree->rank = 0;
+    }
+
+    static void update(node *) {}
+
+    static node *balance(avl_tree &tree, node *parent) {
+        node *left = parent->left;
+        node *right = parent->right;
+        int left_diff = parent->rank - rank(left);
+        int right_diff = parent->rank - rank(right);
+
+        if (left_diff == 0 || right_diff == 0) {
+            // A child was promoted by an insert
+            if (left_diff == 1 || right_diff == 1) {
+                parent->rank++;
+                return parent;
+            }
+            if (left_diff == 0) {
+                if (left->rank - rank(left->right) == 2) {
+                    parent = tree.ll_rotation(parent);
+                    parent->right->rank--;
+                } else {
+                    parent = tree.lr_rotation(parent);
+                    parent->rank++;
+                    parent->left->rank--;
+                    parent->right->rank--;
+                }
+            } else {
+                if (right->rank - rank(right->left) == 2) {
+                    parent = tree.rr_rotation(parent);
+                    parent->left->rank--;
+                } else {
+                    parent = tree.rl_rotation(parent);
+                    parent->rank++;
+                    parent->left->rank--;
+                    parent->right->rank--;
+                }
+            }
+            return parent;
+        }
+
+        if (left == nullptr && right == nullptr && parent->rank > 0) {
+            // A 2,2 leaf left behind by a delete
+            parent->rank = 0;
+            return parent;
+        }
+        if (left_diff == 3 || right_diff == 3) {
+            // A child was demoted by a delete
+            node *sibling = left_diff == 3 ? right : left;
+            if (parent->rank - rank(sibling) == 2) {
+                parent->rank--;
+                return parent;
+            }
+            if (sibling->rank - rank(sibling->left) == 2
+                    && sibling->rank - rank(sibling->right) == 2) {
+                parent->rank--;
+                sibling->rank--;
+                return parent;
+            }
+            if (left_diff == 3) {
+                if (sibling->rank - rank(sibling->right) == 1) {
+                    parent = tree.rr_rotation(parent);
+                    parent->rank++;
+                    node *demoted = parent->left;
+                    demoted->rank--;
+                    if (demoted->left == nullptr && demoted->right == nullptr) {
+                        demoted->rank = 0;
+                    }
+                } else {
+                    parent = tree.rl_rotation(parent);
+                    parent->rank += 2;
+                    parent->left->rank -= 2;
+                    parent->right->rank--;
+                }
+            } else {
+                if (sibling->rank - rank(sibling->left) == 1) {
+                    parent = tree.ll_rotation(parent);
+                    parent->rank++;
+                    node *demoted = parent->right;
+                    demoted->rank--;
+                    if (demoted->left == nullptr && demoted->right == nullptr) {
+                        demoted->rank = 0;
+                    }
+                } else {
+                    parent = tree.lr_rotation(parent);
+                    parent->rank += 2;
+                    parent->right->rank -= 2;
+                    parent->left->rank--;
+                }
+            }
+        }
+        return parent;
+    }
+
+    static node *finish(node *root) {
+        return root;
+    }
+
+    static void build(node *tree, int, int) {
+        tree->rank = 1 + max(rank(tree->left), rank(tree->right));
+    }
+
+    static node *join(avl_tree &tree, node *left, node *middle, node *right) {
+        if (rank(left) > rank(right) + 1) {
+            left->right = join(tree, left->right, middle, right);
+            tree.update(left);
+            return balance(tree, left);
+        } else if (rank(right) > rank(left) + 1) {
+            right->left = join(tree, left, middle, right->left);
+            tree.update(right);
+            return balance(tree, right);
+        }
+        middle->left = left;
+        middle->right = right;
+        middle->rank = 1 + max(rank(left), rank(right));
+        tree.update(middle);
+        return middle;
+    }
+};
+
+// Treap: rank is a random priority, and every node has a higher priority
+// than its children.  A new leaf rotates up while its priority is higher
+// than its parent's; deletes keep the heap order as they are.
+struct treap_balance {
+    static int priority() {
+        static unsigned int seed = 2463534242u;
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return (int) (seed >> 1);
+    }
+
+    static void init(node *tree) {
+        tree->rank = priority();
+    }
+
+    static void update(node *) {}
+
+    static node *balance(avl_tree &tree, node *parent) {
+        if (parent->left != nullptr && parent->left->rank > parent->rank) {
+            return tree.ll_rotation(parent);
+        } else if (parent->right != nullptr && parent->right->rank > parent->rank) {
+            return tree.rr_rotation(parent);
+        }
+        return parent;
+    }
+
+    static node *finish(node *root) {
+        return root;
+    }
+
+    static void build(node *tree, int depth, int) {
+        // Upper levels get higher priorities, so the heap order holds
+        tree->rank = ((64 - depth) << 24) | (priority() & 0xffffff);
+    }
+
+    static node *join(avl_tree &tree, node *left, node *middle, node *right) {
+        if (left != nullptr && left->rank > middle->rank
+                && (right == nullptr || left->rank >= right->rank)) {
+            left->right = join(tree, left->right, middle, right);
+            tree.update(left);
+            return left;
+        } else if (right != nullptr && right->rank > middle->rank) {
+            right->left = join(tree, left, middle, right->left);
+            tree.update(right);
+            return right;
+        }
+        middle->left = left;
+        middle->right = right;
+        tree.update(middle);
+        return middle;
     }
 };
 
+#if defined(BBST_RED_BLACK)
+typedef red_black_balance balance_policy;
+#elif defined(BBST_WAVL)
+typedef wavl_balance balance_policy;
+#elif defined(BBST_TREAP)
+typedef treap_balance balance_policy;
+#else
+typedef avl_balance balance_policy;
+#endif
+
 /*
  * int avl_tree::height(node *)
  * This method computes and returns the height of a tree, receiving a node.
@@ -96,14 +858,11 @@ int avl_tree::difference(node *tree) {
 
 /*
  * int avl_tree::numNodes(node *)
- * This method counts and returns the number of nodes in a given tree.
+ * This method returns the number of values in a given tree, in O(1) using
+ * the subtree sizes.  Tombstones are not counted.
  */
 int avl_tree::numNodes(node *tree) {
-    if (tree == nullptr) {
-        return 0;
-    } else {
-        return 1 + numNodes(tree->left) + numNodes(tree->right);
-    }
+    return size(tree);
 }
 
 /*
@@ -118,7 +877,7 @@ int avl_tree::numNodesSmallerThan(node *tree, int x) {
     if (tree->value == x) {
         return numNodes(tree->left);
     } else if (tree->value < x) {
-        return 1 + numNodes(tree->left) + numNodesSmallerThan(tree->right, x);
+        return alive(tree) + numNodes(tree->left) + numNodesSmallerThan(tree->right, x);
     } else {
         return numNodesSmallerThan(tree->left, x);
     }
@@ -136,7 +895,7 @@ int avl_tree::numNodesGreaterThan(node *tree, int x) {
     if (tree->value == x) {
         return numNodes(tree->right);
     } else if (tree->value > x) {
-        return 1 + numNodes(tree->right) + numNodesGreaterThan(tree->left, x);
+        return alive(tree) + numNodes(tree->right) + numNodesGreaterThan(tree->left, x);
     } else {
         return numNodesGreaterThan(tree->right, x);
     }
@@ -155,63 +914,39 @@ int avl_tree::getNumElements() {
  * This method searches for and returns the kth smallest value within a tree.
  * If k is less than 1 or greater than the total amounts of nodes within the
  * tree, the function raises an exception.
- * This algorithm uses the Morris Traversal
+ * This algorithm walks the values in order through the parent pointers (see
+ * avl_tree::nextNode), without a stack and without writing to the tree, and
+ * stops at the kth one.
  */
 int avl_tree::kSmallest(node *rootNode, int k) {
     if (k < 1 || k > this->elements) {
         throw invalid_argument("impossible value for k");
     }
-    int count = 0;
-    int ksmall = INT_MIN;
-    node *curr = rootNode;
-
-    while (curr != nullptr) {
-        if (curr->left == nullptr) {
-            count++;
-            if (count == k) {
-                ksmall = curr->value;
-            }
-            curr = curr->right;
-        } else {
-            node *pre = curr->left;
-            while (pre->right != nullptr && pre->right != curr) {
-                pre = pre->right;
-            }
-
-            if (pre->right == nullptr) {
-                pre->right = curr;
-                curr = curr->left;
-            } else {
-                pre->right = nullptr;
-                count++;
-                if (count == k) {
-                    ksmall = curr->value;
-                }
-                curr = curr->right;
-            }
-        }
+    node *curr = firstNode(rootNode);
+    for (int count = 1; count < k; count++) {
+        curr = nextNode(rootNode, curr);
     }
-    return ksmall;
+    return curr->value;
 }
 
 /*
  * int avl_tree::kthSmallest(node *, int, int)
  * Recursive private method that let us find the kth smallest number
  * within a tree. It receives the node to look into, the kth needed
- * and the number of visits already done.
+ * and the number of values before that node already accounted for.  The
+ * subtree sizes tell which side the kth value is in, so only one path is
+ * followed.
  */
 int avl_tree::kthSmallest(node *node, int k, int &visits) {
-    int smallest;
-    if (node->left == nullptr) {
-        visits++;
-        if (visits == k) {
-            return node->value;
-        } else {
-            return kthSmallest(node->right, k, visits);
-        }
-    } else {
+    int left = size(node->left);
+    if (k <= visits + left) {
         return kthSmallest(node->left, k, visits);
     }
+    visits += left + alive(node);
+    if (visits == k && alive(node)) {
+        return node->value;
+    }
+    return kthSmallest(node->right, k, visits);
 }
 
 /*
@@ -238,6 +973,8 @@ node *avl_tree::rr_rotation(node *parent) {
     temp = parent->right;
     parent->right = temp->left;
     temp->left = parent;
+    update(parent);
+    update(temp);
     return temp;
 }
 
@@ -250,6 +987,8 @@ node *avl_tree::ll_rotation(node *parent) {
     temp = parent->left;
     parent->left = temp->right;
     temp->right = parent;
+    update(parent);
+    update(temp);
     return temp;
 }
 
@@ -281,47 +1020,139 @@ node *avl_tree::rl_rotation(node *parent) {
 
 /*
  * node *avl_tree::balance(node *)
- * This method balance the tree of a given node.  It gets the difference in
- * height of the node's children.  If the balance factor is less than -1 or
- * if it is greater than 1, the method rotates nodes until the tree is
- * balanced.
+ * This method balances the tree of a given node, after one of its subtrees
+ * changed.  How the tree is kept balanced depends on the policy picked at
+ * compile time (see balance_policy); with the default AVL policy, the method
+ * gets the difference in height of the node's children, and if the balance
+ * factor is less than -1 or greater than 1, it rotates nodes until the tree
+ * is balanced.
  */
 node *avl_tree::balance(node *tree) {
-    int balance_factor = difference(tree);
-    if (balance_factor > 1) {
-        if (difference(tree->left) > 0) {
-            tree = ll_rotation(tree);
-        } else {
-            tree = lr_rotation(tree);
+    return balance_policy::balance(*this, tree);
+}
+
+/*
+ * node *avl_tree::insert(node *, int)
+ * This method inserts a value into the given tree.  If the value is already
+ * within the given tree, the method does nothing.  Values greater than the
+ * current maximum take the append fast path (see avl_tree::appendMax).
+ */
+node *avl_tree::insert(node *rootNode, int value) {
+    int rank;
+    return insertRank(rootNode, value, rank);
+}
+
+/*
+ * node *avl_tree::insertRank(node *, int, int &)
+ * This method works like avl_tree::insert, and also stores in rank the
+ * number of values smaller than the inserted one.  The rank is summed up
+ * from the subtree sizes during the same descent that inserts the value,
+ * so it comes for free instead of costing a second search.
+ */
+node *avl_tree::insertRank(node *rootNode, int value, int &rank) {
+    if (rootNode != nullptr && value > maxValue(rootNode)) {
+        rank = this->elements;
+        return appendMax(rootNode, value);
+    }
+    int before = this->elements;
+    rank = 0;
+    rootNode = balance_policy::finish(insertValue(rootNode, value, rank));
+    if (this->elements != before) {
+        spine.clear();
+        this->version++;
+        trackInsert(rootNode, value);
+    }
+    return rootNode;
+}
+
+/*
+ * int avl_tree::maxValue(node *)
+ * Private method that returns the greatest value of a non-empty tree.  The
+ * value is cached, and only looked up again after the maximum is deleted.
+ */
+int avl_tree::maxValue(node *tree) {
+    if (!maxKnown) {
+        while (tree->right != nullptr) {
+            tree = tree->right;
         }
-    } else if (balance_factor < -1) {
-        if (difference(tree->right) > 0) {
-            tree = rl_rotation(tree);
-        } else {
-            tree = rr_rotation(tree);
+        maxKey = tree->value;
+        maxKnown = true;
+    }
+    return maxKey;
+}
+
+/*
+ * node *avl_tree::appendMax(node *, int)
+ * Private method that inserts a value greater than every value of the tree,
+ * which is common when the values are timestamps.  Instead of descending from
+ * the root, the new leaf is hung from the last node of the saved right spine,
+ * and the spine is walked back up to update and rebalance it.  Rotations
+ * only touch the bottom of the spine, so just that part of the saved path is
+ * recomputed afterwards.
+ */
+node *avl_tree::appendMax(node *tree, int value) {
+    if (spine.empty() || spine[0] != tree) {
+        spine.clear();
+        for (node *current = tree; current != nullptr; current = current->right) {
+            spine.push_back(current);
+        }
+    }
+    node *subtree = newNode(value);
+    this->elements++;
+    lastInserted = subtree;
+    size_t stale = spine.size();
+    for (size_t i = spine.size(); i-- > 0;) {
+        node *current = spine[i];
+        current->right = subtree;
+        update(current);
+        subtree = balance(current);
+        if (subtree != current) {
+            stale = i;
         }
     }
+    tree = balance_policy::finish(subtree);
+    spine.resize(stale);
+    node *current = stale == 0 ? tree : spine[stale - 1]->right;
+    for (; current != nullptr; current = current->right) {
+        spine.push_back(current);
+    }
+    maxKey = value;
+    maxKnown = true;
+    this->version++;
+    trackInsert(tree, value);
     return tree;
 }
 
 /*
- * node *avl_tree::insert(node *, int)
- * This method inserts a value into the given tree.  If the value is already
- * within the given tree, the method does nothing.
+ * node *avl_tree::insertValue(node *, int, int &)
+ * Private recursive method behind avl_tree::insert.  The values passed on
+ * the way down are added to rank.
  */
-node *avl_tree::insert(node *rootNode, int value) {
+node *avl_tree::insertValue(node *rootNode, int value, int &rank) {
     if (rootNode == nullptr) {
-        rootNode = new node;
-        rootNode->value = value;
-        rootNode->left = nullptr;
-        rootNode->right = nullptr;
+        rootNode = newNode(value);
         this->elements += 1;
+        lastInserted = rootNode;
     } else if (value < rootNode->value) {
-        rootNode->left = insert(rootNode->left, value);
+        rootNode->left = insertValue(rootNode->left, value, rank);
+        update(rootNode);
         rootNode = balance(rootNode);
     } else if (value > rootNode->value) {
-        rootNode->right = insert(rootNode->right, value);
+        rank += size(rootNode->left) + alive(rootNode);
+        rootNode->right = insertValue(rootNode->right, value, rank);
+        update(rootNode);
         rootNode = balance(rootNode);
+    } else if (rootNode->deleted) {
+        rank += size(rootNode->left);
+        // Bring back a value that was lazily deleted
+        rootNode->deleted = false;
+        this->tombstones--;
+        this->elements += 1;
+        update(rootNode);
+        lastInserted = rootNode;
+    } else {
+        rank += size(rootNode->left);
+        lastInserted = rootNode;
     }
     return rootNode;
 }
@@ -329,164 +1160,3321 @@ node *avl_tree::insert(node *rootNode, int value) {
 /*
  * node *avl_tree::deleteNode(node *, int)
  * This method removes a value into the given tree.  If the value is not
- * within the given tree, the method does nothing.
+ * within the given tree, the method does nothing.  In lazy delete mode (see
+ * avl_tree::setLazyDelete), the node is only marked as deleted.
  */
 node *avl_tree::deleteNode(node *rootNode, int value) {
-    if (root == nullptr) {
-        return root;
-    }
+    int rank;
+    return eraseRank(rootNode, value, rank);
+}
 
-    if (value < rootNode->value) {
-        rootNode->left = deleteNode(rootNode->left, value);
+/*
+ * node *avl_tree::eraseRank(node *, int, int &)
+ * This method works like avl_tree::deleteNode, and also stores in rank the
+ * number of values smaller than the deleted one, summed up during the same
+ * descent that deletes it.
+ */
+node *avl_tree::eraseRank(node *rootNode, int value, int &rank) {
+    int before = this->elements;
+    rank = 0;
+    if (this->tombstoneLimit > 0) {
+        rootNode = markDeleted(rootNode, value, rank);
     } else {
-        if (value > rootNode->value) {
-            rootNode->right = deleteNode(rootNode->right, value);
-        } else {
-            // If the node has one or no child
-            if (rootNode->left == nullptr) {
-                node *temp = root->right;
-                free(rootNode);
-                this->elements--;
-                return temp;
-            } else if (rootNode->right == nullptr) {
-                    node *temp = root->left;
-                    free(rootNode);
-                    this->elements--;
-                    return temp;
-            }
-            // if the node has two children, then we search for the
-            // inorder successor in the right children tree.
-            node *temp = minValueNode(rootNode->right);
-            rootNode->value = temp->value;
-            rootNode->right = deleteNode(rootNode->right, temp->value);
-        }
-    }
-    balance(rootNode);
+        rootNode = balance_policy::finish(deleteValue(rootNode, value, rank));
+    }
+    if (this->elements != before) {
+        rootNode = settleDelete(rootNode, value);
+    }
     return rootNode;
 }
 
 /*
- * node *avl_tree::minValueNode(node *)
- * This method finds and returns the node with the smallest value within the
- * given tree
+ * node *avl_tree::settleDelete(node *, int)
+ * Private method that brings the caches and the trackers up to date after
+ * value has been deleted, and returns the new root.  With lazy deletes, it
+ * is also where the tree gets rebuilt once there are too many tombstones;
+ * the shape of the tree is unchanged otherwise, so saved paths stay valid.
  */
-node *avl_tree::minValueNode(node *rootNode) {
-    node *current = rootNode;
-    while (current && current->left != nullptr) {
-        current = current->left;
+node *avl_tree::settleDelete(node *tree, int value) {
+    trackDelete(tree, value);
+    if (this->tombstoneLimit > 0) {
+        long nodes = this->elements + this->tombstones;
+        if (this->tombstones * 100L > nodes * this->tombstoneLimit) {
+            tree = purge(tree);
+        }
+        return tree;
     }
-    return current;
+    spine.clear();
+    this->version++;
+    if (value == maxKey) {
+        maxKnown = false;
+    }
+    return tree;
 }
 
 /*
- * node *avl_tree::search(node *, int)
- * This method search for a key within the tree, and returns the node that
- * holds that value if it finds it.
+ * node *avl_tree::eraseKth(node *, int, int &)
+ * This method removes the k-th smallest value of the tree, storing it in
+ * value, and returns the new root.  The node is found by subtree sizes and
+ * removed in the same descent.  If k is out of range, the method raises an
+ * exception.
  */
-node *avl_tree::search(node *tree, int value) {
-    if (tree == nullptr) {
-        return nullptr;
-    }
-    if (tree->value == value) {
-        return tree;
-    } else if (tree->value > value) {
-        return search(tree->left, value);
-    } else {
-        return search(tree->right, value);
+node *avl_tree::eraseKth(node *tree, int k, int &value) {
+    if (k < 1 || k > this->elements) {
+        throw invalid_argument("impossible value for k");
     }
+    tree = balance_policy::finish(deleteKth(tree, k, value));
+    return settleDelete(tree, value);
 }
 
 /*
- * void avl_tree::show(node *, int)
- * Shows the balanced tree.
+ * node *avl_tree::popMin(node *, int &)
+ * Removes the smallest value of the tree, storing it in value, and returns
+ * the new root.  If the tree is empty, the method raises an exception.
  */
-void avl_tree::show(node *position, int level) {
-    int i;
-    if (position != nullptr) {
+node *avl_tree::popMin(node *tree, int &value) {
+    return eraseKth(tree, 1, value);
+}
+
+/*
+ * node *avl_tree::popMax(node *, int &)
+ * Removes the greatest value of the tree, storing it in value, and returns
+ * the new root.  If the tree is empty, the method raises an exception.
+ */
+node *avl_tree::popMax(node *tree, int &value) {
+    return eraseKth(tree, this->elements, value);
+}
+
+/*
+ * int avl_tree::peekMin(node *)
+ * Returns the smallest value of the tree in O(1).  It is kept by a
+ * percentile tracker, registered on the first call, so it follows every
+ * insert and delete.  If the tree is empty, the method raises an exception.
+ */
+int avl_tree::peekMin(node *tree) {
+    if (minTracker < 0) {
+        minTracker = trackPercentile(tree, 0);
+    }
+    return percentile(minTracker);
+}
+
+/*
+ * int avl_tree::peekMax(node *)
+ * Returns the greatest value of the tree in O(1), the same way as
+ * avl_tree::peekMin.  If the tree is empty, the method raises an exception.
+ */
+int avl_tree::peekMax(node *tree) {
+    if (maxTracker < 0) {
+        maxTracker = trackPercentile(tree, 1000);
+    }
+    return percentile(maxTracker);
+}
+
+/*
+ * node *avl_tree::deleteKth(node *, int, int &)
+ * Private recursive method behind avl_tree::eraseKth.  With lazy deletes,
+ * the node is only marked as deleted.
+ */
+node *avl_tree::deleteKth(node *tree, int k, int &value) {
+    int left = size(tree->left);
+    if (k <= left) {
+        tree->left = deleteKth(tree->left, k, value);
+    } else if (k > left + alive(tree)) {
+        tree->right = deleteKth(tree->right, k - left - alive(tree), value);
+    } else {
+        value = tree->value;
+        if (this->tombstoneLimit == 0) {
+            return unlink(tree);
+        }
+        tree->deleted = true;
+        this->tombstones++;
+        this->elements--;
+    }
+    update(tree);
+    return balance(tree);
+}
+
+/*
+ * node *avl_tree::deleteValue(node *, int, int &)
+ * Private recursive method behind avl_tree::deleteNode.  The values passed
+ * on the way down are added to rank.
+ */
+node *avl_tree::deleteValue(node *rootNode, int value, int &rank) {
+    if (rootNode == nullptr) {
+        return rootNode;
+    }
+
+    if (value < rootNode->value) {
+        rootNode->left = deleteValue(rootNode->left, value, rank);
+    } else {
+        if (value > rootNode->value) {
+            rank += size(rootNode->left) + alive(rootNode);
+            rootNode->right = deleteValue(rootNode->right, value, rank);
+        } else {
+            rank += size(rootNode->left);
+            return unlink(rootNode);
+        }
+    }
+    update(rootNode);
+    return balance(rootNode);
+}
+
+/*
+ * node *avl_tree::unlink(node *)
+ * Private method that removes a node from the subtree it is the root of,
+ * and returns the new root of that subtree.
+ */
+node *avl_tree::unlink(node *tree) {
+    // If the node has one or no child
+    if (tree->left == nullptr || tree->right == nullptr) {
+        node *temp = tree->left != nullptr ? tree->left : tree->right;
+        freeNode(tree);
+        this->elements--;
+        return temp;
+    }
+    // if the node has two children, then its inorder successor is taken
+    // out of the right children tree and put in its place.  The successor
+    // node itself is moved rather than its value, so that handles to it
+    // stay valid.
+    node *successor;
+    tree->right = unlinkMin(tree->right, successor);
+    successor->left = tree->left;
+    successor->right = tree->right;
+    successor->rank = tree->rank;
+    freeNode(tree);
+    this->elements--;
+    update(successor);
+    return balance(successor);
+}
+
+/*
+ * node *avl_tree::insertHandle(node *, int, node *&)
+ * This method works like avl_tree::insert, and also stores in handle the
+ * node holding value.  Nodes are never given another value, so the handle
+ * stays valid across later inserts and deletes until the value itself is
+ * deleted, and can be passed to avl_tree::eraseHandle.  The purge of lazy
+ * deletes relinks the nodes in place and keeps handles valid, but
+ * avl_tree::compact and avl_tree::load move nodes, so handles must be
+ * looked up again with avl_tree::search after them.
+ */
+node *avl_tree::insertHandle(node *tree, int value, node *&handle) {
+    tree = insert(tree, value);
+    handle = lastInserted;
+    return tree;
+}
+
+/*
+ * node *avl_tree::eraseHandle(node *, node *)
+ * This method deletes the value held by a node, given a handle to it, and
+ * returns the new root.  There is no search: the node is removed where it
+ * is, and the path back to the root is walked through the parent pointers
+ * to update the sizes and rebalance.
+ */
+node *avl_tree::eraseHandle(node *tree, node *handle) {
+    if (!alive(handle)) {
+        return tree;
+    }
+    int value = handle->value;
+    node *current = handle == tree ? nullptr : handle->parent;
+    bool left = current != nullptr && current->left == handle;
+    node *subtree;
+    if (this->tombstoneLimit > 0) {
+        handle->deleted = true;
+        this->tombstones++;
+        this->elements--;
+        update(handle);
+        subtree = handle;
+    } else {
+        subtree = unlink(handle);
+    }
+    while (current != nullptr) {
+        if (left) {
+            current->left = subtree;
+        } else {
+            current->right = subtree;
+        }
+        node *up = current == tree ? nullptr : current->parent;
+        left = up != nullptr && up->left == current;
+        update(current);
+        subtree = balance(current);
+        current = up;
+    }
+    tree = balance_policy::finish(subtree);
+    return settleDelete(tree, value);
+}
+
+/*
+ * node *avl_tree::minValueNode(node *)
+ * This method finds and returns the node with the smallest value within the
+ * given tree
+ */
+node *avl_tree::minValueNode(node *rootNode) {
+    node *current = rootNode;
+    while (current && current->left != nullptr) {
+        current = current->left;
+    }
+    return current;
+}
+
+/*
+ * node *avl_tree::firstNode(node *)
+ * Returns the node holding the smallest value of the tree, or nullptr if the
+ * tree is empty.  Together with avl_tree::nextNode, it iterates over the
+ * values in order.
+ */
+node *avl_tree::firstNode(node *tree) {
+    node *first = minValueNode(tree);
+    return first == nullptr || alive(first) ? first : nextNode(tree, first);
+}
+
+/*
+ * node *avl_tree::lastNode(node *)
+ * Returns the node holding the greatest value of the tree, or nullptr if the
+ * tree is empty.
+ */
+node *avl_tree::lastNode(node *tree) {
+    node *last = tree;
+    while (last && last->right != nullptr) {
+        last = last->right;
+    }
+    return last == nullptr || alive(last) ? last : prevNode(tree, last);
+}
+
+/*
+ * node *avl_tree::nextNode(node *, node *)
+ * Returns the node holding the next value after the given node's, or
+ * nullptr if it is the last one.  The step follows the parent pointers up
+ * to the root of the given tree, so it needs no stack and only reads the
+ * tree; walking all the values this way costs O(n).
+ */
+node *avl_tree::nextNode(node *tree, node *current) {
+    do {
+        if (current->right != nullptr) {
+            current = minValueNode(current->right);
+        } else {
+            while (current != tree && current == current->parent->right) {
+                current = current->parent;
+            }
+            if (current == tree) {
+                return nullptr;
+            }
+            current = current->parent;
+        }
+    } while (!alive(current));
+    return current;
+}
+
+/*
+ * node *avl_tree::prevNode(node *, node *)
+ * Returns the node holding the previous value before the given node's, or
+ * nullptr if it is the first one.  Mirror of avl_tree::nextNode.
+ */
+node *avl_tree::prevNode(node *tree, node *current) {
+    do {
+        if (current->left != nullptr) {
+            current = current->left;
+            while (current->right != nullptr) {
+                current = current->right;
+            }
+        } else {
+            while (current != tree && current == current->parent->left) {
+                current = current->parent;
+            }
+            if (current == tree) {
+                return nullptr;
+            }
+            current = current->parent;
+        }
+    } while (!alive(current));
+    return current;
+}
+
+/*
+ * node *avl_tree::search(node *, int)
+ * This method search for a key within the tree, and returns the node that
+ * holds that value if it finds it.
+ */
+node *avl_tree::search(node *tree, int value) {
+    if (tree == nullptr) {
+        return nullptr;
+    }
+    if (tree->value == value) {
+        return alive(tree) ? tree : nullptr;
+    } else if (tree->value > value) {
+        return search(tree->left, value);
+    } else {
+        return search(tree->right, value);
+    }
+}
+
+/*
+ * void avl_tree::show(node *, int)
+ * Shows the balanced tree, without the values deleted lazily.
+ */
+void avl_tree::show(node *position, int level) {
+    int i;
+    if (position != nullptr) {
         show(position->right, level + 1);
-        cout << " ";
-        if (position == root) {
-            cout << "Root -> ";
+        if (alive(position)) {
+            cout << " ";
+            if (position == root) {
+                cout << "Root -> ";
+            }
+            for (i = 0; (i < level) && (position != root); i++) {
+                cout << " ";
+            }
+            cout << position->value;
+        }
+        show(position->left, level + 1);
+    }
+}
+
+/*
+ * void avl_tree::inorder(node *)
+ * Shows the tree inorder traversal.
+ */
+void avl_tree::inorder(node *tree) {
+    if (tree == nullptr) {
+        return;
+    }
+    inorder(tree->left);
+    if (alive(tree)) {
+        cout << tree->value << " ";
+    }
+    inorder(tree->right);
+}
+
+/*
+ * void avl_tree::preorder(node *)
+ * Shows the tree preorder traversal
+ */
+void avl_tree::preorder(node *tree) {
+    if (tree == nullptr) {
+        return;
+    }
+    if (alive(tree)) {
+        cout << tree->value << " ";
+    }
+    preorder(tree->left);
+    preorder(tree->right);
+}
+
+/*
+ * void avl_tree::postorder(node *)
+ * Shows the tree postorder traversal
+ */
+void avl_tree::postorder(node *tree) {
+    if (tree == nullptr) {
+        return;
+    }
+    postorder(tree->left);
+    postorder(tree->right);
+    if (alive(tree)) {
+        cout << tree->value << " ";
+    }
+}
+
+/*
+ * int avl_tree::bottomK(node *, int, int *)
+ * Copies the k smallest values of the tree into out, in increasing order,
+ * and returns how many were copied (fewer than k if the tree is smaller).
+ * Runs in O(log n + k).
+ */
+int avl_tree::bottomK(node *tree, int k, int *out) {
+    if (k < 0) {
+        throw invalid_argument("impossible value for k");
+    }
+    return copyOut(tree, INT_MIN, INT_MAX, out, k, false);
+}
+
+/*
+ * int avl_tree::topK(node *, int, int *)
+ * Copies the k greatest values of the tree into out, in decreasing order,
+ * and returns how many were copied.  Runs in O(log n + k).
+ */
+int avl_tree::topK(node *tree, int k, int *out) {
+    if (k < 0) {
+        throw invalid_argument("impossible value for k");
+    }
+    return copyOut(tree, INT_MIN, INT_MAX, out, k, true);
+}
+
+/*
+ * int avl_tree::rangeValues(node *, int, int, int *, int)
+ * Copies the values in [lo, hi] into out, in increasing order, stopping
+ * after capacity values.  Returns how many were copied.
+ */
+int avl_tree::rangeValues(node *tree, int lo, int hi, int *out, int capacity) {
+    return copyOut(tree, lo, hi, out, capacity, false);
+}
+
+/*
+ * int avl_tree::copyOut(node *, int, int, int *, int, bool)
+ * Private method behind the bulk copies: walks the values in [lo, hi] in
+ * increasing (or decreasing) order with an explicit stack, copying at most
+ * capacity of them into out.  The stack starts as the path to the first
+ * value of the range, so only O(log n) nodes are visited before it.
+ */
+int avl_tree::copyOut(node *tree, int lo, int hi, int *out, int capacity, bool descending) {
+    vector<node *> stack;
+    while (tree != nullptr) {
+        if (descending ? tree->value <= hi : tree->value >= lo) {
+            stack.push_back(tree);
+            tree = descending ? tree->right : tree->left;
+        } else {
+            tree = descending ? tree->left : tree->right;
+        }
+    }
+    int copied = 0;
+    while (!stack.empty() && copied < capacity) {
+        node *current = stack.back();
+        stack.pop_back();
+        if (descending ? current->value < lo : current->value > hi) {
+            break;
+        }
+        if (alive(current)) {
+            out[copied++] = current->value;
+        }
+        node *next = descending ? current->left : current->right;
+        for (; next != nullptr; next = descending ? next->right : next->left) {
+            stack.push_back(next);
+        }
+    }
+    return copied;
+}
+
+/*
+ * void snapshot_writer::begin(int)
+ * Writes the header of a snapshot of count values.
+ */
+void snapshot_writer::begin(int count) {
+    if (fwrite(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), 1, file) != 1
+            || fwrite(&count, sizeof(int), 1, file) != 1) {
+        failed = true;
+    }
+    offset = sizeof(SNAPSHOT_MAGIC) + sizeof(int);
+}
+
+/*
+ * void snapshot_writer::add(int)
+ * Adds a value to the current block, writing the block to the file once it
+ * is full.  Values must be added in increasing order.
+ */
+void snapshot_writer::add(int value) {
+    values[count++] = value;
+    if (count == SNAPSHOT_BLOCK) {
+        flush();
+    }
+}
+
+/*
+ * void snapshot_writer::flush()
+ * Encodes the buffered values as a block and writes it to the file.
+ */
+void snapshot_writer::flush() {
+    if (count == 0) {
+        return;
+    }
+    unsigned char payload[SNAPSHOT_BLOCK * 5];
+    int bytes = 0;
+    for (int i = 1; i < count; i++) {
+        unsigned int delta = (unsigned int) values[i] - (unsigned int) values[i - 1];
+        while (delta >= 0x80) {
+            payload[bytes++] = (unsigned char) (delta | 0x80);
+            delta >>= 7;
+        }
+        payload[bytes++] = (unsigned char) delta;
+    }
+    snapshot_block block = {count, values[0], values[count - 1], bytes};
+    if (fwrite(&block, sizeof(block), 1, file) != 1
+            || fwrite(payload, 1, bytes, file) != (size_t) bytes) {
+        failed = true;
+    }
+    index.push_back({block, offset});
+    offset += sizeof(block) + bytes;
+    count = 0;
+}
+
+/*
+ * void snapshot_writer::finish()
+ * Writes the last block, then the index and the trailer.
+ */
+void snapshot_writer::finish() {
+    flush();
+    const char padding[alignof(snapshot_entry)] = {};
+    long skip = (alignof(snapshot_entry) - offset % alignof(snapshot_entry)) % alignof(snapshot_entry);
+    snapshot_trailer trailer = {offset + skip, (int) index.size(), {}};
+    memcpy(trailer.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    if (fwrite(padding, 1, skip, file) != (size_t) skip
+            || (!index.empty()
+                && fwrite(index.data(), sizeof(snapshot_entry), index.size(), file) != index.size())
+            || fwrite(&trailer, sizeof(trailer), 1, file) != 1) {
+        failed = true;
+    }
+}
+
+/*
+ * int snapshot_reader::next()
+ * Decodes and returns the next value of the snapshot.  Each block header is
+ * checked as it is reached, and the next one is found through its bytes.
+ * Values must be strictly increasing, and a block must end exactly at its
+ * last byte, on a value equal to its max; otherwise failed is set and the
+ * method returns 0 from then on.
+ */
+int snapshot_reader::next() {
+    if (failed) {
+        return 0;
+    }
+    if (left == 0) {
+        pos = blockEnd;
+        if (end - pos < (long) sizeof(block)) {
+            failed = true;
+            return 0;
+        }
+        memcpy(&block, pos, sizeof(block));
+        pos += sizeof(block);
+        if (block.count < 1 || block.count > SNAPSHOT_BLOCK || block.bytes < 0
+                || end - pos < block.bytes || block.min <= last) {
+            failed = true;
+            return 0;
+        }
+        blockEnd = pos + block.bytes;
+        left = block.count;
+        last = block.min;
+    } else {
+        unsigned long delta = 0;
+        int shift = 0;
+        while (pos < blockEnd && (*pos & 0x80) && shift < 28) {
+            delta |= (unsigned long) (*pos++ & 0x7f) << shift;
+            shift += 7;
+        }
+        if (pos == blockEnd || (*pos & 0x80)) {
+            failed = true;
+            return 0;
+        }
+        delta |= (unsigned long) *pos++ << shift;
+        last += delta;
+        if (delta == 0 || last > INT_MAX) {
+            failed = true;
+            return 0;
+        }
+    }
+    if (--left == 0 && (pos != blockEnd || last != block.max)) {
+        failed = true;
+        return 0;
+    }
+    return (int) last;
+}
+
+/*
+ * void snapshot_map::open(const char *, int)
+ * Maps the snapshot at path, gives the kernel the madvise advice for it,
+ * and checks everything but the blocks: the magic numbers, that the index
+ * entries follow each other through the file up to the index, that their
+ * values are increasing from one block to the next, and that they add up
+ * to the number of values.  If any of this fails, the method raises an
+ * exception.
+ */
+void snapshot_map::open(const char *path, int advice) {
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("cannot open snapshot");
+    }
+    struct stat info;
+    const long header_size = sizeof(SNAPSHOT_MAGIC) + sizeof(int);
+    snapshot_trailer trailer;
+    if (fstat(fd, &info) < 0 || info.st_size < header_size + (long) sizeof(trailer)) {
+        ::close(fd);
+        throw runtime_error("invalid snapshot");
+    }
+    void *mapped = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+        throw runtime_error("cannot map snapshot");
+    }
+    madvise(mapped, info.st_size, advice);
+    data = (const unsigned char *) mapped;
+    length = info.st_size;
+
+    memcpy(&count, data + sizeof(SNAPSHOT_MAGIC), sizeof(int));
+    memcpy(&trailer, data + length - sizeof(trailer), sizeof(trailer));
+    long entries = length - sizeof(trailer) - trailer.index;
+    bool valid = memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+            && memcmp(trailer.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) == 0
+            && count >= 0 && trailer.blocks >= 0 && trailer.index >= header_size
+            && trailer.index % alignof(snapshot_entry) == 0
+            && entries == (long) sizeof(snapshot_entry) * trailer.blocks;
+    if (valid) {
+        index = (const snapshot_entry *) (data + trailer.index);
+        blocks = trailer.blocks;
+    }
+    long offset = header_size;
+    long total = 0;
+    for (int i = 0; valid && i < blocks; i++) {
+        const snapshot_block &block = index[i].block;
+        valid = index[i].offset == offset
+                && block.count >= 1 && block.count <= SNAPSHOT_BLOCK
+                && block.bytes >= 0 && trailer.index - offset - (long) sizeof(block) >= block.bytes
+                && (block.count == 1 ? block.min == block.max : block.min < block.max)
+                && (i == 0 || block.min > index[i - 1].block.max);
+        offset += sizeof(block) + block.bytes;
+        total += block.count;
+    }
+    if (!valid || trailer.index - offset >= (long) alignof(snapshot_entry) || total != count) {
+        close();
+        throw runtime_error("invalid snapshot");
+    }
+}
+
+/*
+ * bool snapshot_map::decode(int, int *) const
+ * Decodes the values of the given block into out, which must have room for
+ * SNAPSHOT_BLOCK of them.  Returns false if the block is malformed (see
+ * snapshot_reader::next) or doesn't match its index entry.
+ */
+bool snapshot_map::decode(int block, int *out) const {
+    const snapshot_entry &entry = index[block];
+    const unsigned char *start = data + entry.offset;
+    snapshot_reader values(start, start + sizeof(entry.block) + entry.block.bytes);
+    for (int i = 0; i < entry.block.count; i++) {
+        out[i] = values.next();
+    }
+    return !values.failed && values.left == 0
+            && memcmp(&values.block, &entry.block, sizeof(entry.block)) == 0;
+}
+
+/*
+ * void snapshot_map::close()
+ * Unmaps the snapshot, if one is mapped.
+ */
+void snapshot_map::close() {
+    if (data != nullptr) {
+        munmap((void *) data, length);
+    }
+    data = nullptr;
+    length = 0;
+    count = 0;
+    index = nullptr;
+    blocks = 0;
+}
+
+/*
+ * void avl_tree::serialize(node *, snapshot_writer &)
+ * Writes the values of the given tree in inorder traversal, so the writer
+ * receives them sorted.
+ */
+void avl_tree::serialize(node *tree, snapshot_writer &writer) {
+    if (tree == nullptr) {
+        return;
+    }
+    serialize(tree->left, writer);
+    if (alive(tree)) {
+        writer.add(tree->value);
+    }
+    serialize(tree->right, writer);
+}
+
+/*
+ * pid_t avl_tree::checkpoint(node *, const char *)
+ * This method saves a consistent snapshot of the tree to the given path
+ * without pausing the caller.  It forks the process: the child serializes
+ * the tree from its copy-on-write view of memory and exits, while the parent
+ * returns right away and keeps applying operations.  The snapshot holds the
+ * sorted values compressed in blocks, with an index of the blocks (see
+ * snapshot_writer).  The child writes it to a temporary file named after
+ * its pid and syncs it; the parent renames that file over path when it
+ * collects the child (see waitCheckpoint), so readers never see a partial
+ * snapshot, and checkpoints of the same path never wait for each other.
+ * Returns the pid of the child, or -1 if the fork failed.
+ */
+pid_t avl_tree::checkpoint(node *tree, const char *path) {
+    // Flush buffered output so the child doesn't write it a second time
+    cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return pid;
+    } else if (pid > 0) {
+        checkpoints.push_back({pid, path, string(path) + "." + to_string(pid) + ".tmp", false});
+        return pid;
+    }
+    string temp = string(path) + "." + to_string(getpid()) + ".tmp";
+    FILE *file = fopen(temp.c_str(), "wb");
+    if (file == nullptr) {
+        _exit(1);
+    }
+    snapshot_writer writer(file);
+    writer.begin(this->elements);
+    serialize(tree, writer);
+    writer.finish();
+    bool written = fflush(file) == 0 && fsync(fileno(file)) == 0 && !writer.failed;
+    if (fclose(file) != 0 || !written) {
+        ::unlink(temp.c_str());
+        _exit(1);
+    }
+    _exit(0);
+}
+
+/*
+ * void avl_tree::waitCheckpoint(size_t, bool)
+ * Private method that collects the i-th pending checkpoint if it is done,
+ * or waits for it if block is true, counting it if it failed.  A finished
+ * snapshot is renamed over its path, unless a newer one of the same path
+ * already was; the older checkpoints of that path still pending become
+ * stale, so the newest snapshot is the one left whatever order they finish
+ * in.
+ */
+void avl_tree::waitCheckpoint(size_t i, bool block) {
+    int status;
+    pid_t pid = waitpid(checkpoints[i].pid, &status, block ? 0 : WNOHANG);
+    if (pid == 0) {
+        return;
+    }
+    pending_checkpoint done = checkpoints[i];
+    checkpoints.erase(checkpoints.begin() + i);
+    bool written = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (written && !done.stale) {
+        written = rename(done.temp.c_str(), done.path.c_str()) == 0;
+        if (written) {
+            // Checkpoints are kept in the order they were forked
+            for (size_t j = 0; j < i; j++) {
+                if (checkpoints[j].path == done.path) {
+                    checkpoints[j].stale = true;
+                }
+            }
+            return;
+        }
+    }
+    if (!written) {
+        failedCheckpoints++;
+    }
+    ::unlink(done.temp.c_str());
+}
+
+/*
+ * int avl_tree::reapCheckpoints(bool)
+ * Collects the checkpoint children that have already finished.  If block is
+ * true, the method waits until every pending checkpoint is done.  Returns
+ * the number of checkpoints that have failed so far.
+ */
+int avl_tree::reapCheckpoints(bool block) {
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        waitCheckpoint(i, block);
+    }
+    return failedCheckpoints;
+}
+
+/*
+ * void avl_tree::awaitCheckpoint(const char *)
+ * Waits until the pending checkpoints writing the given path, if any, are
+ * done, so that the file holds the newest snapshot saved there.  Other
+ * checkpoints keep running.
+ */
+void avl_tree::awaitCheckpoint(const char *path) {
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        if (checkpoints[i].path == path) {
+            waitCheckpoint(i, true);
+        }
+    }
+}
+
+/*
+ * node *avl_tree::buildFromSorted(Source &, int)
+ * This method builds a balanced tree out of count sorted values in O(n),
+ * without comparisons or rotations.  Nodes are created in inorder, so the
+ * values are pulled one by one from the source, through its next() method.
+ */
+template <typename Source>
+node *avl_tree::buildFromSorted(Source &values, int count) {
+    int full = 0;
+    while ((2L << full) - 1 <= count) {
+        full++;
+    }
+    return buildLevel(values, count, 0, full);
+}
+
+/*
+ * node *avl_tree::assign(node *, Source &, int)
+ * This method replaces every value of the tree with count sorted values
+ * pulled from the source, building the new tree in O(n) with
+ * avl_tree::buildFromSorted, and returns its root.  A tree emptied this way
+ * frees its slabs, unless a compaction is running.
+ */
+template <typename Source>
+node *avl_tree::assign(node *tree, Source &values, int count) {
+    destroy(tree);
+    if (count == 0 && !compacting()) {
+        for (node *slab : slabs) {
+            delete[] slab;
+        }
+        slabs.clear();
+        this->freeNodes = nullptr;
+        this->slabUsed = 0;
+        this->slabCapacity = 0;
+        this->lastInserted = nullptr;
+    }
+    tree = buildFromSorted(values, count);
+    this->elements = count;
+    this->tombstones = 0;
+    spine.clear();
+    this->version++;
+    maxKnown = false;
+    resetTrackers(tree);
+    return tree;
+}
+
+/*
+ * node *avl_tree::buildLevel(Source &, int, int, int)
+ * Private recursive method behind avl_tree::buildFromSorted.  It builds a
+ * subtree of count values at the given depth of a tree whose first full
+ * levels are complete.
+ */
+template <typename Source>
+node *avl_tree::buildLevel(Source &values, int count, int depth, int full) {
+    if (count <= 0) {
+        return nullptr;
+    }
+    node *left = buildLevel(values, count / 2, depth + 1, full);
+    node *tree = takeNode(values);
+    tree->left = left;
+    tree->right = buildLevel(values, count - count / 2 - 1, depth + 1, full);
+    update(tree);
+    balance_policy::build(tree, depth, full);
+    return tree;
+}
+
+/*
+ * node *avl_tree::takeNode(Source &)
+ * Private method that makes the next node of a bulk build, holding the next
+ * value pulled from the source.
+ */
+template <typename Source>
+node *avl_tree::takeNode(Source &values) {
+    return newNode(values.next());
+}
+
+/*
+ * node *avl_tree::takeNode(node_source &)
+ * Private method that hands the next existing node to a bulk build, which
+ * relinks it in place, so handles to it stay valid.
+ */
+node *avl_tree::takeNode(node_source &nodes) {
+    return *nodes.next_node++;
+}
+
+/*
+ * node *avl_tree::load(node *, const char *)
+ * This method replaces the given tree with the snapshot stored at path (see
+ * avl_tree::checkpoint) and returns the new root.  The file is mapped into
+ * memory instead of read, and the blocks are decoded straight into the new
+ * nodes.  Every block is decoded and checked once beforehand (see
+ * snapshot_map), so that a torn or corrupt file never reaches the tree: if
+ * the file can't be loaded, the method raises an exception and the tree is
+ * left untouched.  This builds all n nodes up front; lazy_snapshot serves a
+ * snapshot without doing so.
+ */
+node *avl_tree::load(node *tree, const char *path) {
+    snapshot_map snapshot;
+    snapshot.open(path, MADV_SEQUENTIAL);
+    int scratch[SNAPSHOT_BLOCK];
+    for (int i = 0; i < snapshot.blocks; i++) {
+        if (!snapshot.decode(i, scratch)) {
+            throw runtime_error("invalid snapshot");
+        }
+    }
+    const unsigned char *first = snapshot.data + sizeof(SNAPSHOT_MAGIC) + sizeof(int);
+    snapshot_reader values(first, (const unsigned char *) snapshot.index);
+    return assign(tree, values, snapshot.count);
+}
+
+/*
+ * void avl_tree::destroy(node *)
+ * Frees every node of the given tree.
+ */
+void avl_tree::destroy(node *tree) {
+    if (tree == nullptr) {
+        return;
+    }
+    destroy(tree->left);
+    destroy(tree->right);
+    freeNode(tree);
+}
+
+/*
+ * void avl_tree::update(node *)
+ * Recomputes the bookkeeping fields of a node from its children, and points
+ * the children back to it.  It must be called every time the children of a
+ * node change.
+ */
+void avl_tree::update(node *tree) {
+    tree->size = alive(tree) + size(tree->left) + size(tree->right);
+    balance_policy::update(tree);
+    int settled = tree->epoch;
+    if (tree->left != nullptr) {
+        tree->left->parent = tree;
+        settled = min(settled, tree->left->settled);
+    }
+    if (tree->right != nullptr) {
+        tree->right->parent = tree;
+        settled = min(settled, tree->right->settled);
+    }
+    tree->settled = settled;
+}
+
+/*
+ * node *avl_tree::newNode(int)
+ * Allocates a leaf holding the given value.  Nodes are carved out of slabs
+ * growing geometrically from NODE_SLAB nodes, reusing the ones that have
+ * been freed first.
+ * Keeping nodes in their own slabs, apart from the rest of the heap, also
+ * bounds what a checkpoint costs: after the fork, only the pages of the
+ * nodes the parent writes get copied.  Slabs opt out of transparent huge
+ * pages for the same reason, so each of those writes copies 4 KB instead of
+ * 2 MB.
+ */
+node *avl_tree::newNode(int value) {
+    node *fresh;
+    if (freeNodes != nullptr) {
+        fresh = freeNodes;
+        freeNodes = freeNodes->left;
+    } else {
+        if (slabUsed == slabCapacity) {
+            slabCapacity = max({NODE_SLAB, 2 * slabCapacity, this->elements});
+            slabs.push_back(new node[slabCapacity]);
+            slabUsed = 0;
+#if defined(MADV_NOHUGEPAGE)
+            // madvise needs page boundaries: cover the whole pages inside
+            uintptr_t page = sysconf(_SC_PAGESIZE);
+            uintptr_t first = ((uintptr_t) slabs.back() + page - 1) & ~(page - 1);
+            uintptr_t last = (uintptr_t) (slabs.back() + slabCapacity) & ~(page - 1);
+            if (first < last) {
+                madvise((void *) first, last - first, MADV_NOHUGEPAGE);
+            }
+#endif
+        }
+        fresh = &slabs.back()[slabUsed++];
+    }
+    fresh->value = value;
+    fresh->left = nullptr;
+    fresh->right = nullptr;
+    fresh->parent = nullptr;
+    fresh->size = 1;
+    fresh->deleted = false;
+    balance_policy::init(fresh);
+    fresh->epoch = this->epoch;
+    fresh->settled = this->epoch;
+    return fresh;
+}
+
+/*
+ * void avl_tree::freeNode(node *)
+ * Gives a node back to the tree's allocator.  Nodes that live in a slab
+ * being evacuated by a compaction are just dropped, since the whole slab is
+ * released once the compaction ends.
+ */
+void avl_tree::freeNode(node *tree) {
+    if (tree->epoch != this->epoch) {
+        return;
+    }
+    tree->left = freeNodes;
+    freeNodes = tree;
+}
+
+/*
+ * node *avl_tree::relocate(node *, int &)
+ * Private method that copies the nodes of a tree that haven't been moved yet
+ * into the current slabs, in preorder, until budget nodes have been moved.
+ * Subtrees that are already settled are skipped without being visited.
+ * Returns the (possibly moved) root of the tree.
+ */
+node *avl_tree::relocate(node *tree, int &budget) {
+    if (tree == nullptr || tree->settled == this->epoch || budget == 0) {
+        return tree;
+    }
+    if (tree->epoch != this->epoch) {
+        node *moved = newNode(tree->value);
+        moved->rank = tree->rank;
+        moved->deleted = tree->deleted;
+        moved->left = tree->left;
+        moved->right = tree->right;
+        tree = moved;
+        budget--;
+    }
+    tree->left = relocate(tree->left, budget);
+    tree->right = relocate(tree->right, budget);
+    update(tree);
+    return tree;
+}
+
+/*
+ * node *avl_tree::compact(node *, int)
+ * This method rewrites the nodes of the tree into fresh contiguous memory,
+ * in preorder, so that lookups touch fewer cache lines after a long run of
+ * inserts and deletes.  It works in slices: each call moves at most budget
+ * nodes and returns the new root, so it can run between operations without
+ * long pauses.  Once every node has been moved, the old slabs are freed.
+ * Nodes inserted while a compaction is running are placed in the new slabs
+ * directly.
+ */
+node *avl_tree::compact(node *tree, int budget) {
+    if (!compacting()) {
+        // Start a new compaction: every existing node becomes stale
+        this->epoch++;
+        this->liveSlab = slabs.size();
+        this->freeNodes = nullptr;
+        this->slabUsed = 0;
+        this->slabCapacity = 0;
+    }
+    tree = relocate(tree, budget);
+    spine.clear();
+    this->version++;
+    if (tree == nullptr || tree->settled == this->epoch) {
+        for (size_t i = 0; i < liveSlab; i++) {
+            delete[] slabs[i];
+        }
+        slabs.erase(slabs.begin(), slabs.begin() + liveSlab);
+        liveSlab = 0;
+    }
+    return tree;
+}
+
+/*
+ * bool avl_tree::compacting()
+ * Returns true if a compaction has been started and hasn't finished yet.
+ */
+bool avl_tree::compacting() {
+    return liveSlab > 0;
+}
+
+/*
+ * int avl_tree::size(node *)
+ * Returns the number of nodes in the given tree, in O(1).
+ */
+int avl_tree::size(node *tree) {
+    return tree == nullptr ? 0 : tree->size;
+}
+
+/*
+ * void avl_tree::interleave(node *, const int *, int, Step)
+ * Private method that runs count independent descents of the tree, one per
+ * key, LOOKUP_LANES at a time.  Instead of finishing one descent before
+ * starting the next, it advances every lane by one level in round-robin and
+ * prefetches the node each lane will visit next, so the cache misses of the
+ * different lanes overlap.  step(lane) moves a lane one level down and
+ * returns false once the lane's lookup is done.
+ */
+template <typename Step>
+void avl_tree::interleave(node *tree, const int *keys, int count, Step step) {
+    lookup_lane lanes[LOOKUP_LANES];
+    int active = 0;
+    int next = 0;
+    while (active < LOOKUP_LANES && next < count) {
+        lanes[active] = {tree, next, keys[next], 0};
+        active++;
+        next++;
+    }
+    while (active > 0) {
+        for (int i = 0; i < active; i++) {
+            if (step(lanes[i])) {
+                __builtin_prefetch(lanes[i].current);
+            } else if (next < count) {
+                lanes[i] = {tree, next, keys[next], 0};
+                next++;
+            } else {
+                lanes[i--] = lanes[--active];
+            }
+        }
+    }
+}
+
+/*
+ * void avl_tree::searchBatch(node *, const int *, int, node **)
+ * Batched version of avl_tree::search.  It looks for count keys at once and
+ * stores in results[i] the node that holds keys[i], or nullptr.
+ */
+void avl_tree::searchBatch(node *tree, const int *keys, int count, node **results) {
+    interleave(tree, keys, count, [this, results](lookup_lane &lane) {
+        node *current = lane.current;
+        if (current == nullptr || current->value == lane.key) {
+            results[lane.index] = current != nullptr && alive(current) ? current : nullptr;
+            return false;
+        }
+        lane.current = lane.key < current->value ? current->left : current->right;
+        return true;
+    });
+}
+
+/*
+ * void avl_tree::rankBatch(node *, const int *, int, int *)
+ * Batched version of avl_tree::numNodesSmallerThan.  It stores in results[i]
+ * the number of values in the tree smaller than keys[i], using the subtree
+ * sizes to do it in a single descent per key.
+ */
+void avl_tree::rankBatch(node *tree, const int *keys, int count, int *results) {
+    interleave(tree, keys, count, [this, results](lookup_lane &lane) {
+        node *current = lane.current;
+        if (current == nullptr) {
+            results[lane.index] = lane.acc;
+            return false;
+        }
+        if (current->value < lane.key) {
+            lane.acc += size(current->left) + alive(current);
+            lane.current = current->right;
+        } else {
+            lane.current = current->left;
+        }
+        return true;
+    });
+}
+
+/*
+ * void avl_tree::selectBatch(node *, const int *, int, int *)
+ * Batched version of avl_tree::kSmallest.  It stores in results[i] the
+ * ranks[i]th smallest value in the tree.  If any of the ranks is less than 1
+ * or greater than the total amount of nodes, the method raises an exception.
+ */
+void avl_tree::selectBatch(node *tree, const int *ranks, int count, int *results) {
+    for (int i = 0; i < count; i++) {
+        if (ranks[i] < 1 || ranks[i] > size(tree)) {
+            throw invalid_argument("impossible value for k");
+        }
+    }
+    interleave(tree, ranks, count, [this, results](lookup_lane &lane) {
+        node *current = lane.current;
+        int left = size(current->left);
+        if (lane.key == left + 1 && alive(current)) {
+            results[lane.index] = current->value;
+            return false;
+        }
+        if (lane.key <= left) {
+            lane.current = current->left;
+        } else {
+            lane.key -= left + alive(current);
+            lane.current = current->right;
+        }
+        return true;
+    });
+}
+
+/*
+ * void avl_tree::selectSplit(node *, const int *, int, int, int *)
+ * Private recursive method behind avl_tree::selectMany.  offset is the
+ * number of values smaller than every value in the given tree.  The sorted
+ * ranks are split at the node: the ones that fall in the left subtree go
+ * left, the ones that fall in the right subtree go right, and the one equal
+ * to the node's own rank is answered on the spot.
+ */
+void avl_tree::selectSplit(node *tree, const int *ranks, int count, int offset, int *results) {
+    if (count == 0) {
+        return;
+    }
+    int position = offset + size(tree->left) + alive(tree);
+    int lo = upper_bound(ranks, ranks + count, offset + size(tree->left)) - ranks;
+    int hi = upper_bound(ranks, ranks + count, position) - ranks;
+    selectSplit(tree->left, ranks, lo, offset, results);
+    for (int i = lo; i < hi; i++) {
+        results[i] = tree->value;
+    }
+    selectSplit(tree->right, ranks + hi, count - hi, position, results + hi);
+}
+
+/*
+ * void avl_tree::selectMany(node *, const int *, int, int *)
+ * This method finds the ranks[i]th smallest value of the tree for every i
+ * and stores it in results[i], in one descent shared by all the ranks.  The
+ * ranks must be sorted.  If any of the ranks is less than 1 or greater than
+ * the total amount of nodes, the method raises an exception.
+ */
+void avl_tree::selectMany(node *tree, const int *ranks, int count, int *results) {
+    if (count > 0 && (ranks[0] < 1 || ranks[count - 1] > size(tree))) {
+        throw invalid_argument("impossible value for k");
+    }
+    if (!is_sorted(ranks, ranks + count)) {
+        throw invalid_argument("ranks must be sorted");
+    }
+    selectSplit(tree, ranks, count, 0, results);
+}
+
+/*
+ * void avl_tree::rankSplit(node *, const int *, int, int, int *)
+ * Private recursive method behind avl_tree::rankMany.  It works like
+ * avl_tree::selectSplit, splitting the sorted keys by the node's value.
+ */
+void avl_tree::rankSplit(node *tree, const int *keys, int count, int offset, int *results) {
+    if (count == 0) {
+        return;
+    }
+    if (tree == nullptr) {
+        for (int i = 0; i < count; i++) {
+            results[i] = offset;
+        }
+        return;
+    }
+    int smaller = offset + size(tree->left);
+    int lo = lower_bound(keys, keys + count, tree->value) - keys;
+    int hi = upper_bound(keys, keys + count, tree->value) - keys;
+    rankSplit(tree->left, keys, lo, offset, results);
+    for (int i = lo; i < hi; i++) {
+        results[i] = smaller;
+    }
+    rankSplit(tree->right, keys + hi, count - hi, smaller + alive(tree), results + hi);
+}
+
+/*
+ * void avl_tree::rankMany(node *, const int *, int, int *)
+ * This method counts, for every i, the number of values in the tree smaller
+ * than keys[i] and stores it in results[i], in one descent shared by all the
+ * keys.  The keys must be sorted.
+ */
+void avl_tree::rankMany(node *tree, const int *keys, int count, int *results) {
+    if (!is_sorted(keys, keys + count)) {
+        throw invalid_argument("keys must be sorted");
+    }
+    rankSplit(tree, keys, count, 0, results);
+}
+
+/*
+ * void avl_tree::bucketCounts(node *, const int *, int, int *)
+ * This method counts the values of the tree that fall in each of the buckets
+ * delimited by count sorted boundaries.  counts must have room for count + 1
+ * buckets: counts[0] gets the values smaller than bounds[0], counts[i] the
+ * values in [bounds[i - 1], bounds[i]), and counts[count] the values greater
+ * than or equal to the last boundary.  The ranks of all the boundaries are
+ * found in a single descent (see avl_tree::rankMany).
+ */
+void avl_tree::bucketCounts(node *tree, const int *bounds, int count, int *counts) {
+    rankMany(tree, bounds, count, counts);
+    counts[count] = size(tree);
+    for (int i = count; i > 0; i--) {
+        counts[i] -= counts[i - 1];
+    }
+}
+
+/*
+ * int avl_tree::selectMerged(node *, const int *, const int *, int, int)
+ * This method returns the kth smallest value of the tree as it would be
+ * after count writes, given as sorted keys with their deltas: +1 for a key
+ * missing from the tree that gets inserted, -1 for a key of the tree that
+ * gets deleted.  The ranks of all the keys are found in one pass (see
+ * avl_tree::rankMany); between two keys, the values are the tree's, so the
+ * kth one is either an inserted key or a select in the tree.  If k is out
+ * of range, the method raises an exception.
+ */
+int avl_tree::selectMerged(node *tree, const int *keys, const int *deltas, int count, int k) {
+    int total = size(tree);
+    for (int i = 0; i < count; i++) {
+        total += deltas[i];
+    }
+    if (k < 1 || k > total) {
+        throw invalid_argument("impossible value for k");
+    }
+    vector<int> below(count);
+    rankMany(tree, keys, count, below.data());
+    int merged = 0;     // values before the current key
+    int used = 0;       // values of the tree among them, deleted ones too
+    for (int i = 0; i < count; i++) {
+        if (merged + below[i] - used >= k) {
+            break;
+        }
+        merged += below[i] - used;
+        used = below[i];
+        if (deltas[i] < 0) {
+            used++;
+        } else if (++merged == k) {
+            return keys[i];
+        }
+    }
+    return selectNode(tree, used + k - merged)->value;
+}
+
+/*
+ * node *avl_tree::selectNode(node *, int)
+ * This method returns the node holding the kth smallest value of the tree,
+ * in O(log n) using the subtree sizes, or nullptr if there is no such node.
+ */
+node *avl_tree::selectNode(node *tree, int k) {
+    while (tree != nullptr) {
+        int left = size(tree->left);
+        if (k == left + 1 && alive(tree)) {
+            return tree;
+        } else if (k <= left) {
+            tree = tree->left;
+        } else {
+            k -= left + alive(tree);
+            tree = tree->right;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * node *avl_tree::nextValueNode(node *, int)
+ * This method returns the node with the smallest value greater than the
+ * given one, or nullptr if there is none.  If the closest node is a
+ * tombstone, the next value is found by rank instead.
+ */
+node *avl_tree::nextValueNode(node *tree, int value) {
+    node *next = nullptr;
+    for (node *current = tree; current != nullptr;) {
+        if (current->value > value) {
+            next = current;
+            current = current->left;
+        } else {
+            current = current->right;
+        }
+    }
+    if (next != nullptr && !alive(next)) {
+        int rank = numNodesSmallerThan(tree, value) + (search(tree, value) != nullptr);
+        next = selectNode(tree, rank + 1);
+    }
+    return next;
+}
+
+/*
+ * node *avl_tree::prevValueNode(node *, int)
+ * This method returns the node with the greatest value smaller than the
+ * given one, or nullptr if there is none.  If the closest node is a
+ * tombstone, the previous value is found by rank instead.
+ */
+node *avl_tree::prevValueNode(node *tree, int value) {
+    node *prev = nullptr;
+    for (node *current = tree; current != nullptr;) {
+        if (current->value < value) {
+            prev = current;
+            current = current->right;
+        } else {
+            current = current->left;
+        }
+    }
+    if (prev != nullptr && !alive(prev)) {
+        prev = selectNode(tree, numNodesSmallerThan(tree, value));
+    }
+    return prev;
+}
+
+/*
+ * int avl_tree::trackPercentile(node *, int)
+ * Registers a tracker for the given percentile, expressed in permille (500
+ * is the median), and returns its id.  If the percentile is already tracked,
+ * the existing tracker is returned.  The tracker follows every insert and
+ * delete, so avl_tree::percentile can read it in O(1).
+ */
+int avl_tree::trackPercentile(node *tree, int permille) {
+    if (permille < 0 || permille > 1000) {
+        throw invalid_argument("impossible value for the percentile");
+    }
+    for (size_t i = 0; i < trackers.size(); i++) {
+        if (trackers[i].permille == permille) {
+            return i;
+        }
+    }
+    trackers.push_back({permille, 0, 0});
+    shiftTracker(tree, trackers.back());
+    return trackers.size() - 1;
+}
+
+/*
+ * int avl_tree::percentile(int)
+ * Returns the current value of the given tracker.  If the tree is empty,
+ * the method raises an exception.
+ */
+int avl_tree::percentile(int id) {
+    if (trackers[id].rank == 0) {
+        throw invalid_argument("empty tree");
+    }
+    return trackers[id].value;
+}
+
+/*
+ * void avl_tree::resetTrackers(node *)
+ * Recomputes every tracker from scratch, after the tree has been replaced.
+ */
+void avl_tree::resetTrackers(node *tree) {
+    for (percentile_tracker &tracker : trackers) {
+        tracker.rank = 0;
+        shiftTracker(tree, tracker);
+    }
+}
+
+/*
+ * void avl_tree::shiftTracker(node *, percentile_tracker &)
+ * Private method that moves a tracker to the rank its percentile has in the
+ * current tree.  After a single insert or delete, the target rank is at most
+ * one away, so the tracker just steps to the neighbouring value.
+ */
+void avl_tree::shiftTracker(node *tree, percentile_tracker &tracker) {
+    int n = this->elements;
+    int target = max(1, (int) (((long) tracker.permille * n + 999) / 1000));
+    if (n == 0) {
+        tracker.rank = 0;
+    } else if (tracker.rank == 0 || abs(target - tracker.rank) > 1) {
+        tracker.rank = target;
+        tracker.value = selectNode(tree, target)->value;
+    } else if (target > tracker.rank) {
+        tracker.rank++;
+        tracker.value = nextValueNode(tree, tracker.value)->value;
+    } else if (target < tracker.rank) {
+        tracker.rank--;
+        tracker.value = prevValueNode(tree, tracker.value)->value;
+    }
+}
+
+/*
+ * void avl_tree::trackInsert(node *, int)
+ * Private method that updates the trackers after value has been inserted.
+ */
+void avl_tree::trackInsert(node *tree, int value) {
+    for (percentile_tracker &tracker : trackers) {
+        if (tracker.rank > 0 && value < tracker.value) {
+            tracker.rank++;
+        }
+        shiftTracker(tree, tracker);
+    }
+}
+
+/*
+ * void avl_tree::trackDelete(node *, int)
+ * Private method that updates the trackers after value has been deleted.
+ */
+void avl_tree::trackDelete(node *tree, int value) {
+    for (percentile_tracker &tracker : trackers) {
+        if (value == tracker.value) {
+            // The tracked value is gone, look the target up again
+            tracker.rank = 0;
+        } else if (tracker.rank > 0 && value < tracker.value) {
+            tracker.rank--;
+        }
+        shiftTracker(tree, tracker);
+    }
+}
+
+/*
+ * node *avl_tree::deleteBatch(node *, const int *, int)
+ * This method removes count sorted values from the tree and returns the new
+ * root.  The values share one descent (see avl_tree::subtract), which costs
+ * O(m log(n / m + 1)) for m values instead of m separate deletes.
+ */
+node *avl_tree::deleteBatch(node *tree, const int *values, int count) {
+    if (tree == nullptr || count <= 0) {
+        return tree;
+    }
+    tree = balance_policy::finish(subtract(tree, values, count));
+    this->elements = size(tree);
+    spine.clear();
+    maxKnown = false;
+    this->version++;
+    resetTrackers(tree);
+    return tree;
+}
+
+/*
+ * node *avl_tree::subtract(node *, const int *, int)
+ * Private recursive method behind avl_tree::deleteBatch.  The sorted values
+ * are split around the root's value and each side is removed from the
+ * matching subtree; the two results are then joined back with the policy's
+ * join, through the root, or through the smallest node of the right side if
+ * the root's value was one of those removed.  Subtrees no value falls in are
+ * not visited.  Tombstones are left as they are.
+ */
+node *avl_tree::subtract(node *tree, const int *values, int count) {
+    if (tree == nullptr || count == 0) {
+        return tree;
+    }
+    int below = lower_bound(values, values + count, tree->value) - values;
+    int above = upper_bound(values + below, values + count, tree->value) - values;
+    node *left = subtract(tree->left, values, below);
+    node *right = subtract(tree->right, values + above, count - above);
+    if (below == above || !alive(tree)) {
+        return balance_policy::join(*this, left, tree, right);
+    }
+    freeNode(tree);
+    if (right == nullptr) {
+        return left;
+    }
+    node *min;
+    right = unlinkMin(right, min);
+    return balance_policy::join(*this, left, min, right);
+}
+
+/*
+ * void avl_tree::fingerClimb(node *, tree_finger &, int)
+ * Private method that pops nodes off the finger's path until the last one
+ * holds value within its range.  If the tree changed since the finger was
+ * saved, the path is restarted from the root.
+ */
+void avl_tree::fingerClimb(node *tree, tree_finger &finger, int value) {
+    if (finger.version != this->version || finger.path.empty()
+            || finger.path[0] != tree) {
+        finger.path.assign(1, tree);
+        finger.low.assign(1, LONG_MIN);
+        finger.high.assign(1, LONG_MAX);
+        finger.version = this->version;
+    }
+    while (finger.path.size() > 1
+            && (value <= finger.low.back() || value >= finger.high.back())) {
+        finger.path.pop_back();
+        finger.low.pop_back();
+        finger.high.pop_back();
+    }
+}
+
+/*
+ * void avl_tree::fingerDescend(tree_finger &, int)
+ * Private method that extends the finger's path towards value, until it
+ * reaches the node holding it or the last node before a null child.
+ */
+void avl_tree::fingerDescend(tree_finger &finger, int value) {
+    node *current = finger.path.back();
+    while (current != nullptr && current->value != value) {
+        long low = finger.low.back();
+        long high = finger.high.back();
+        if (value < current->value) {
+            high = current->value;
+            current = current->left;
+        } else {
+            low = current->value;
+            current = current->right;
+        }
+        if (current != nullptr) {
+            finger.path.push_back(current);
+            finger.low.push_back(low);
+            finger.high.push_back(high);
+        }
+    }
+}
+
+/*
+ * node *avl_tree::fingerSearch(node *, tree_finger &, int)
+ * This method works like avl_tree::search, but starts from the node the
+ * finger was left at, climbing only until the value is within range.  When
+ * lookups cluster, most of the path from the root is skipped.  The finger is
+ * left at the last node visited.
+ */
+node *avl_tree::fingerSearch(node *tree, tree_finger &finger, int value) {
+    if (tree == nullptr) {
+        return nullptr;
+    }
+    fingerClimb(tree, finger, value);
+    fingerDescend(finger, value);
+    node *found = finger.path.back();
+    return found->value == value && alive(found) ? found : nullptr;
+}
+
+/*
+ * node *avl_tree::fingerInsert(node *, tree_finger &, int)
+ * This method works like avl_tree::insert, but the value is inserted into
+ * the subtree reached by climbing from the finger.  The nodes above it are
+ * then updated and rebalanced along the saved path, and only the part of the
+ * path below the highest rotation is looked up again.  Returns the new root,
+ * and leaves the finger at the node holding value.
+ */
+node *avl_tree::fingerInsert(node *tree, tree_finger &finger, int value) {
+    if (tree == nullptr) {
+        return insert(tree, value);
+    }
+    fingerClimb(tree, finger, value);
+    size_t level = finger.path.size() - 1;
+    node *top = finger.path[level];
+    int before = this->elements;
+    int rank = 0;
+    node *subtree = insertValue(top, value, rank);
+    if (this->elements == before) {
+        fingerDescend(finger, value);
+        return tree;
+    }
+    size_t stale = subtree != top ? level : finger.path.size();
+    for (size_t i = level; i-- > 0;) {
+        node *current = finger.path[i];
+        if (value < current->value) {
+            current->left = subtree;
+        } else {
+            current->right = subtree;
+        }
+        update(current);
+        subtree = balance(current);
+        if (subtree != current) {
+            stale = i;
+        }
+    }
+    tree = balance_policy::finish(subtree);
+
+    // Replace the part of the path that rotations moved around
+    if (stale < finger.path.size()) {
+        node *moved = tree;
+        if (stale > 0) {
+            node *parent = finger.path[stale - 1];
+            moved = value < parent->value ? parent->left : parent->right;
+        }
+        finger.path.resize(stale + 1);
+        finger.low.resize(stale + 1);
+        finger.high.resize(stale + 1);
+        finger.path[stale] = moved;
+    }
+    spine.clear();
+    if (maxKnown && value > maxKey) {
+        maxKey = value;
+    }
+    this->version++;
+    finger.version = this->version;
+    fingerDescend(finger, value);
+    trackInsert(tree, value);
+    return tree;
+}
+
+/*
+ * int avl_tree::alive(node *)
+ * Returns 1 if the given node holds a value, or 0 if it is a tombstone left
+ * by a lazy delete.
+ */
+int avl_tree::alive(node *tree) {
+    return tree->deleted ? 0 : 1;
+}
+
+/*
+ * node *avl_tree::setLazyDelete(node *, int)
+ * Turns lazy deletes on or off.  While they are on, avl_tree::deleteNode
+ * just marks the node as a tombstone and updates the subtree sizes on the
+ * way back, so it costs the same as a search and ranks stay exact.  Once
+ * tombstones make up more than limit percent of the nodes, the tree is
+ * rebuilt without them.  A limit of 0 turns lazy deletes off, purging the
+ * tombstones left.  Returns the new root.
+ */
+node *avl_tree::setLazyDelete(node *tree, int limit) {
+    this->tombstoneLimit = max(0, min(limit, 100));
+    if (this->tombstoneLimit == 0 && this->tombstones > 0) {
+        tree = purge(tree);
+    }
+    return tree;
+}
+
+/*
+ * node *avl_tree::markDeleted(node *, int, int &)
+ * Private recursive method behind lazy deletes: it marks the node holding
+ * value as deleted, adding the values passed on the way down to rank, and
+ * fixes the sizes on the way back up.
+ */
+node *avl_tree::markDeleted(node *tree, int value, int &rank) {
+    if (tree == nullptr) {
+        return tree;
+    }
+    if (value < tree->value) {
+        tree->left = markDeleted(tree->left, value, rank);
+    } else if (value > tree->value) {
+        rank += size(tree->left) + alive(tree);
+        tree->right = markDeleted(tree->right, value, rank);
+    } else if (alive(tree)) {
+        rank += size(tree->left);
+        tree->deleted = true;
+        this->tombstones++;
+        this->elements--;
+    } else {
+        rank += size(tree->left);
+        return tree;
+    }
+    update(tree);
+    return tree;
+}
+
+/*
+ * void avl_tree::sweep(node *, vector<node *> &)
+ * Appends the live nodes of the tree to the vector, in inorder traversal,
+ * and frees the tombstones.
+ */
+void avl_tree::sweep(node *tree, vector<node *> &nodes) {
+    if (tree == nullptr) {
+        return;
+    }
+    node *right = tree->right;
+    sweep(tree->left, nodes);
+    if (alive(tree)) {
+        nodes.push_back(tree);
+    } else {
+        freeNode(tree);
+    }
+    sweep(right, nodes);
+}
+
+/*
+ * node *avl_tree::purge(node *)
+ * Private method that rebuilds the tree without its tombstones, in O(n)
+ * through avl_tree::buildFromSorted, and returns the new root.  The live
+ * nodes are relinked where they are rather than copied, so handles to them
+ * (see avl_tree::insertHandle) survive the rebuild.
+ */
+node *avl_tree::purge(node *tree) {
+    vector<node *> nodes;
+    nodes.reserve(this->elements);
+    sweep(tree, nodes);
+    node_source source = {nodes.data()};
+    tree = buildFromSorted(source, nodes.size());
+    this->tombstones = 0;
+    this->spine.clear();
+    this->maxKnown = false;
+    this->version++;
+    return tree;
+}
+
+/*
+ * void avl_tree::split(node *, int, node *&, node *&, node *&)
+ * Private recursive method that splits a tree into the values smaller than
+ * value, the node holding value (or nullptr), and the values greater than
+ * it.  The pieces are put back together with the policy's join on the way
+ * up, reusing the nodes of the path as middle nodes, so the whole split
+ * costs O(log n).
+ */
+void avl_tree::split(node *tree, int value, node *&left, node *&match, node *&right) {
+    if (tree == nullptr) {
+        left = match = right = nullptr;
+    } else if (value < tree->value) {
+        node *greater;
+        split(tree->left, value, left, match, greater);
+        right = balance_policy::join(*this, greater, tree, tree->right);
+    } else if (value > tree->value) {
+        node *smaller;
+        split(tree->right, value, smaller, match, right);
+        left = balance_policy::join(*this, tree->left, tree, smaller);
+    } else {
+        left = tree->left;
+        right = tree->right;
+        match = tree;
+        match->left = match->right = nullptr;
+    }
+}
+
+/*
+ * node *avl_tree::unlinkMin(node *, node *&)
+ * Private recursive method that unlinks the node with the smallest value of
+ * a non-empty tree, rebalancing on the way back up.  The node is stored in
+ * min and the new root is returned.
+ */
+node *avl_tree::unlinkMin(node *tree, node *&min) {
+    if (tree->left == nullptr) {
+        min = tree;
+        node *right = tree->right;
+        tree->right = nullptr;
+        return right;
+    }
+    tree->left = unlinkMin(tree->left, min);
+    update(tree);
+    return balance(tree);
+}
+
+/*
+ * int avl_tree::discard(node *)
+ * Private method that frees every node of a detached tree, returning how
+ * many of them were tombstones.
+ */
+int avl_tree::discard(node *tree) {
+    if (tree == nullptr) {
+        return 0;
+    }
+    int dead = 1 - alive(tree) + discard(tree->left) + discard(tree->right);
+    freeNode(tree);
+    return dead;
+}
+
+/*
+ * node *avl_tree::eraseRange(node *, int, int)
+ * This method removes every value in [lo, hi] from the tree and returns the
+ * new root.  The range is cut out with two splits and the remaining pieces
+ * are joined back, which takes O(log n) whatever the size of the range;
+ * the detached nodes are then given back to the allocator in one pass.
+ */
+node *avl_tree::eraseRange(node *tree, int lo, int hi) {
+    if (tree == nullptr || lo > hi) {
+        return tree;
+    }
+    node *below, *first, *rest, *middle, *last, *above;
+    split(tree, lo, below, first, rest);
+    split(rest, hi, middle, last, above);
+    this->tombstones -= discard(first) + discard(middle) + discard(last);
+
+    if (above == nullptr) {
+        tree = below;
+    } else {
+        node *min;
+        above = unlinkMin(above, min);
+        tree = balance_policy::join(*this, below, min, above);
+    }
+    tree = balance_policy::finish(tree);
+    this->elements = size(tree);
+    spine.clear();
+    maxKnown = false;
+    this->version++;
+    resetTrackers(tree);
+    return tree;
+}
+
+/*
+ * void sorted_writes::record(int, bool, Contains)
+ * Adds a write making value present in the set or not.  A write undoing a
+ * pending one cancels it; otherwise contains(value) tells whether the value
+ * is in the set, and a write leaving the set as it is, is dropped.
+ */
+template <typename Contains>
+void sorted_writes::record(int value, bool present, Contains contains) {
+    size_t i = lower_bound(keys.begin(), keys.end(), value) - keys.begin();
+    if (i < keys.size() && keys[i] == value) {
+        if ((deltas[i] > 0) != present) {
+            if (deltas[i] < 0) {
+                deletes.erase(lower_bound(deletes.begin(), deletes.end(), value));
+            }
+            net -= deltas[i];
+            keys.erase(keys.begin() + i);
+            deltas.erase(deltas.begin() + i);
+        }
+        return;
+    }
+    if (contains(value) == present) {
+        return;
+    }
+    int delta = present ? 1 : -1;
+    keys.insert(keys.begin() + i, value);
+    deltas.insert(deltas.begin() + i, delta);
+    if (!present) {
+        deletes.insert(lower_bound(deletes.begin(), deletes.end(), value), value);
+    }
+    net += delta;
+}
+
+/*
+ * int sorted_writes::below(int)
+ * Returns the sum of the deltas of the writes to values smaller than x.
+ */
+int sorted_writes::below(int x) {
+    int writes = lower_bound(keys.begin(), keys.end(), x) - keys.begin();
+    int deleted = lower_bound(deletes.begin(), deletes.end(), x) - deletes.begin();
+    return writes - 2 * deleted;
+}
+
+/*
+ * bool sorted_writes::select(int, Rank, int &)
+ * Finds the kth smallest value of the set with the writes applied, k being
+ * in range, given rank(x), the number of values of the set smaller than x.
+ * A binary search over the writes finds the first one with at least k
+ * values before it, in O(log writes) calls to rank.  If the kth value is
+ * an insert, found is set to it and the method returns true; otherwise
+ * found is set to the rank, from 1, of the kth value among those of the
+ * set, and the method returns false.
+ */
+template <typename Rank>
+bool sorted_writes::select(int k, Rank rank, int &found) {
+    // Values before the ith write
+    auto before = [&](int i) {
+        return rank(keys[i]) + below(keys[i]);
+    };
+    int low = 0;
+    int high = keys.size();
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (before(middle) >= k) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    if (low > 0 && deltas[low - 1] > 0 && before(low - 1) == k - 1) {
+        found = keys[low - 1];
+        return true;
+    }
+    // Every write before the low-th one comes before the kth value, and
+    // none of the others does
+    found = k - (low < (int) keys.size() ? below(keys[low]) : net);
+    return false;
+}
+
+/*
+ * void sorted_writes::clear()
+ * Drops every pending write.
+ */
+void sorted_writes::clear() {
+    keys.clear();
+    deltas.clear();
+    deletes.clear();
+    net = 0;
+}
+
+// Keeps a tree holding only the keys inserted by the last W events.  Every
+// inserted key also enters a FIFO ring; when it falls out of the window it
+// is deleted from the tree, unless it was inserted again in the meantime.
+class sliding_window {
+    // Number of events of a key currently in the window
+    struct occurrences {
+        int count;
+        long since;     // first event that counts, older ones were deleted
+    };
+    struct event {
+        int key;
+        long id;
+    };
+
+    avl_tree &tree;
+    vector<event> ring;
+    size_t head;
+    size_t count;
+    size_t capacity;
+    long events;
+    unordered_map<int, occurrences> keys;
+    node *expire(node *);
+public:
+    explicit sliding_window(avl_tree &tree)
+            : tree(tree), head(0), count(0), capacity(0), events(0) {}
+    void resize(int);
+    bool enabled();
+    node *insert(node *, int);
+    node *deleteNode(node *, int);
+    node *eraseRange(node *, int, int);
+    void clear();
+};
+
+/*
+ * void sliding_window::resize(int)
+ * Changes the size of the window.  A size of 0 disables the window.  If the
+ * window shrinks, the extra events expire over the next inserts.
+ */
+void sliding_window::resize(int size) {
+    vector<event> resized(max(size, (int) count));
+    for (size_t i = 0; i < count; i++) {
+        resized[i] = ring[(head + i) % ring.size()];
+    }
+    ring.swap(resized);
+    head = 0;
+    capacity = max(size, 0);
+    if (capacity == 0) {
+        clear();
+    }
+}
+
+/*
+ * bool sliding_window::enabled()
+ * Returns true if the window has a size.
+ */
+bool sliding_window::enabled() {
+    return capacity > 0;
+}
+
+/*
+ * node *sliding_window::expire(node *)
+ * Private method that drops the oldest event of the window, deleting its key
+ * from the tree if no newer event of the same key is left.  Returns the new
+ * root of the tree.
+ */
+node *sliding_window::expire(node *tree) {
+    event oldest = ring[head];
+    head = (head + 1) % ring.size();
+    count--;
+    auto found = keys.find(oldest.key);
+    if (found != keys.end() && oldest.id >= found->second.since
+            && --found->second.count == 0) {
+        keys.erase(found);
+        tree = this->tree.deleteNode(tree, oldest.key);
+    }
+    return tree;
+}
+
+/*
+ * node *sliding_window::insert(node *, int)
+ * Inserts a key into the tree as a new event of the window, and returns the
+ * new root.  Keys can be inserted more than once; a key leaves the tree when
+ * its last event expires.  Each insert expires at most two events, so a
+ * shrinking window is drained without long pauses.
+ */
+node *sliding_window::insert(node *tree, int key) {
+    for (int i = 0; i < 2 && count >= capacity; i++) {
+        tree = expire(tree);
+    }
+    occurrences &found = keys[key];
+    if (found.count++ == 0) {
+        found.since = events;
+        tree = this->tree.insert(tree, key);
+    }
+    ring[(head + count) % ring.size()] = {key, events++};
+    count++;
+    return tree;
+}
+
+/*
+ * node *sliding_window::deleteNode(node *, int)
+ * Deletes a key from the tree right away, together with all its events in
+ * the window, and returns the new root.
+ */
+node *sliding_window::deleteNode(node *tree, int key) {
+    keys.erase(key);
+    return this->tree.deleteNode(tree, key);
+}
+
+/*
+ * node *sliding_window::eraseRange(node *, int, int)
+ * Deletes every key in [lo, hi] from the tree, together with their events in
+ * the window, and returns the new root.
+ */
+node *sliding_window::eraseRange(node *tree, int lo, int hi) {
+    for (auto it = keys.begin(); it != keys.end();) {
+        if (it->first >= lo && it->first <= hi) {
+            it = keys.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return this->tree.eraseRange(tree, lo, hi);
+}
+
+/*
+ * void sliding_window::clear()
+ * Forgets every event, leaving the keys in the tree.
+ */
+void sliding_window::clear() {
+    head = 0;
+    count = 0;
+    keys.clear();
+}
+
+// Number of levels of the timer wheel, and bits of the tick used per level.
+// Each level has 64 slots, so the wheel covers 2^24 ticks; later deadlines
+// wait in the last level and are placed again when it turns.
+const int WHEEL_LEVELS = 4;
+const int WHEEL_BITS = 6;
+const int WHEEL_SLOTS = 1 << WHEEL_BITS;
+
+// Hierarchical timer wheel holding the deadlines of keys with a time to live.
+// Scheduling and expiring a key are O(1); a timer is moved down one level at
+// most once per level, when the slot it sits in comes due.
+class timer_wheel {
+    struct timer {
+        int key;
+        long deadline;
+    };
+
+    vector<timer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    long now;
+    unordered_map<int, long> deadlines;  // current deadline of every key
+    void place(const timer &);
+    long nextDue();
+public:
+    timer_wheel() : now(0) {}
+    void schedule(int, long);
+    void cancel(int);
+    void advance(long, vector<int> &);
+    void clear();
+};
+
+/*
+ * void timer_wheel::place(const timer &)
+ * Private method that puts a timer in the slot of the lowest level whose
+ * span covers the time left until its deadline.
+ */
+void timer_wheel::place(const timer &entry) {
+    long left = entry.deadline - now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && left >= (1L << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    long tick = min(entry.deadline, now + (1L << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+    int slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    slots[level][slot].push_back(entry);
+}
+
+/*
+ * void timer_wheel::schedule(int, long)
+ * Makes key expire ttl ticks from now, replacing any previous deadline.
+ */
+void timer_wheel::schedule(int key, long ttl) {
+    timer entry = {key, now + max(ttl, 1L)};
+    deadlines[key] = entry.deadline;
+    place(entry);
+}
+
+/*
+ * void timer_wheel::cancel(int)
+ * Removes the deadline of key, if it has one.  The timer itself stays in its
+ * slot and is ignored when it comes due.
+ */
+void timer_wheel::cancel(int key) {
+    deadlines.erase(key);
+}
+
+/*
+ * void timer_wheel::clear()
+ * Removes every deadline and every timer, keeping the clock where it is.
+ */
+void timer_wheel::clear() {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            slots[level][slot].clear();
+        }
+    }
+    deadlines.clear();
+}
+
+/*
+ * long timer_wheel::nextDue()
+ * Private method that returns the first tick after now at which a non-empty
+ * slot comes due: a slot of level 0 holding timers, or the turn of an upper
+ * level onto a slot holding timers to move down.  Each level is looked at
+ * over one turn, so this is O(levels * slots).  Returns LONG_MAX if every
+ * slot is empty.
+ */
+long timer_wheel::nextDue() {
+    long due = LONG_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        for (long turn = (now >> shift) + 1; turn <= (now >> shift) + WHEEL_SLOTS; turn++) {
+            if ((turn << shift) >= due) {
+                break;
+            }
+            if (!slots[level][turn & (WHEEL_SLOTS - 1)].empty()) {
+                due = turn << shift;
+                break;
+            }
+        }
+    }
+    return due;
+}
+
+/*
+ * void timer_wheel::advance(long, vector<int> &)
+ * Moves the clock forward by the given number of ticks and appends to
+ * expired, sorted, every key whose deadline has passed.  The clock jumps
+ * straight from one due slot to the next (see timer_wheel::nextDue), so the
+ * cost depends on the timers handled, not on the number of ticks.
+ */
+void timer_wheel::advance(long ticks, vector<int> &expired) {
+    size_t first = expired.size();
+    long target = now + max(ticks, 0L);
+    while (now < target) {
+        long next = deadlines.empty() ? LONG_MAX : nextDue();
+        if (next > target) {
+            now = target;
+            break;
+        }
+        now = next;
+        // Move the timers of the upper levels that are now due down, from
+        // the highest one, since they may land in a lower slot due now
+        int top = 0;
+        while (top + 1 < WHEEL_LEVELS
+                && (now & ((1L << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level > 0; level--) {
+            int slot = (now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            vector<timer> due;
+            due.swap(slots[level][slot]);
+            for (const timer &entry : due) {
+                place(entry);
+            }
+        }
+        vector<timer> due;
+        due.swap(slots[0][now & (WHEEL_SLOTS - 1)]);
+        for (const timer &entry : due) {
+            auto found = deadlines.find(entry.key);
+            if (found != deadlines.end() && found->second == entry.deadline
+                    && entry.deadline <= now) {
+                deadlines.erase(found);
+                expired.push_back(entry.key);
+            } else if (found != deadlines.end() && found->second == entry.deadline) {
+                place(entry);
+            }
+        }
+    }
+    sort(expired.begin() + first, expired.end());
+}
+
+// Interface of the fronts main puts before the tree for C, K, I and D:
+// small_tree, adaptive_tree, write_buffer and lazy_snapshot.  A front may
+// hold values outside of the tree, so the root it is given and returns is
+// only the tree's part; expand moves every value to the tree before an
+// operation the front doesn't support.  A run of queries starts with
+// prepareReads, which may change the tree; the queries themselves only
+// read, so several of them can run concurrently.
+class tree_front {
+public:
+    virtual ~tree_front() {}
+    virtual node *insert(node *, int) = 0;
+    virtual node *deleteNode(node *, int) = 0;
+    virtual node *prepareReads(node *root, int) {
+        return root;
+    }
+    virtual int numNodesSmallerThan(node *, int) = 0;
+    virtual int kSmallest(node *, int) = 0;
+    virtual int getNumElements() = 0;
+    virtual node *expand(node *) = 0;
+};
+
+// Largest number of values a small_tree keeps inline.  Once it has been
+// moved to nodes, it only goes back when half of them are left, so a size
+// going back and forth around the limit doesn't convert it every time.
+const int SMALL_KEYS = 64;
+
+// Front for a tree that usually holds few values: up to SMALL_KEYS of them
+// are kept in a sorted array, which is smaller and faster to search than
+// nodes.  Past that, the values are moved to the avl_tree, and the root is
+// the one returned by insert and deleteNode.  While the values are inline,
+// that root is nullptr; expand moves them to the tree before operations
+// the array doesn't support.  The array lives in a front rather than in
+// avl_tree itself because every avl_tree method takes and returns a node
+// root, which inline values don't have; code using avl_tree directly gets
+// the small first slab instead (see NODE_SLAB), and the slabs are freed when
+// the values move back inline (see avl_tree::assign).
+class small_tree : public tree_front {
+    avl_tree &tree;
+    int keys[SMALL_KEYS];
+    int count;
+    bool expanded;
+    int below(int);
+    node *shrink(node *);
+public:
+    explicit small_tree(avl_tree &tree) : tree(tree), count(0), expanded(false) {}
+    node *insert(node *, int) override;
+    node *deleteNode(node *, int) override;
+    int numNodesSmallerThan(node *, int) override;
+    int kSmallest(node *, int) override;
+    int getNumElements() override;
+    node *expand(node *) override;
+};
+
+/*
+ * int small_tree::below(int)
+ * Private method that returns the number of inline values smaller than
+ * value, which is also where value is or would go in the array.  With SSE2,
+ * four values are compared at once; the array is short enough that a scan
+ * beats the branches of a binary search.
+ */
+int small_tree::below(int value) {
+#if defined(__SSE2__)
+    __m128i needle = _mm_set1_epi32(value);
+    int smaller = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (keys + i));
+        __m128i less = _mm_cmplt_epi32(block, needle);
+        smaller += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(less)));
+    }
+    for (; i < count; i++) {
+        smaller += keys[i] < value;
+    }
+    return smaller;
+#else
+    return lower_bound(keys, keys + count, value) - keys;
+#endif
+}
+
+/*
+ * node *small_tree::insert(node *, int)
+ * Inserts a value, moving every value to the tree if the array is full, and
+ * returns the root.  Like avl_tree::insert, it does nothing if the value is
+ * already there.
+ */
+node *small_tree::insert(node *root, int value) {
+    if (expanded) {
+        return tree.insert(root, value);
+    }
+    int i = below(value);
+    if (i < count && keys[i] == value) {
+        return root;
+    }
+    if (count == SMALL_KEYS) {
+        root = expand(root);
+        return tree.insert(root, value);
+    }
+    memmove(keys + i + 1, keys + i, (count - i) * sizeof(int));
+    keys[i] = value;
+    count++;
+    return root;
+}
+
+/*
+ * node *small_tree::deleteNode(node *, int)
+ * Deletes a value and returns the root.  The values go back inline once the
+ * tree is down to half of SMALL_KEYS.
+ */
+node *small_tree::deleteNode(node *root, int value) {
+    if (expanded) {
+        root = tree.deleteNode(root, value);
+        if (tree.getNumElements() <= SMALL_KEYS / 2) {
+            root = shrink(root);
+        }
+        return root;
+    }
+    int i = below(value);
+    if (i < count && keys[i] == value) {
+        count--;
+        memmove(keys + i, keys + i + 1, (count - i) * sizeof(int));
+    }
+    return root;
+}
+
+/*
+ * int small_tree::numNodesSmallerThan(node *, int)
+ * Returns the number of values smaller than x.
+ */
+int small_tree::numNodesSmallerThan(node *root, int x) {
+    return expanded ? tree.numNodesSmallerThan(root, x) : below(x);
+}
+
+/*
+ * int small_tree::kSmallest(node *, int)
+ * Returns the kth smallest value.  If k is less than 1 or greater than the
+ * number of values, the method raises an exception.
+ */
+int small_tree::kSmallest(node *root, int k) {
+    if (expanded) {
+        return tree.kSmallest_v2(root, k);
+    }
+    if (k < 1 || k > count) {
+        throw invalid_argument("impossible value for k");
+    }
+    return keys[k - 1];
+}
+
+/*
+ * int small_tree::getNumElements()
+ * Returns the number of values.
+ */
+int small_tree::getNumElements() {
+    return expanded ? tree.getNumElements() : count;
+}
+
+/*
+ * node *small_tree::expand(node *)
+ * Moves the inline values to the tree, if they are not there already, and
+ * returns its root.  The tree is built in O(n) from the sorted array.
+ */
+node *small_tree::expand(node *root) {
+    if (!expanded) {
+        array_source values = {keys};
+        root = tree.assign(root, values, count);
+        expanded = true;
+    }
+    return root;
+}
+
+/*
+ * node *small_tree::shrink(node *)
+ * Private method that moves the values of the tree back inline, returning
+ * the empty root.
+ */
+node *small_tree::shrink(node *root) {
+    count = tree.bottomK(root, SMALL_KEYS, keys);
+    array_source none = {keys};
+    root = tree.assign(root, none, 0);
+    expanded = false;
+    return root;
+}
+
+// Number of operations per sample of an adaptive_tree, and the percentage
+// of writes below which it switches to the array, and from which it goes
+// back to nodes.  The gap between the two keeps a mixed load from flipping
+// the layout at every sample.
+const int ADAPT_SAMPLE = 1024;
+const int ADAPT_FREEZE = 5;
+const int ADAPT_THAW = 20;
+
+// Smallest number of writes an adaptive_tree holds beside its array before
+// merging them in; past that, up to the square root of the array's size
+const int ADAPT_RUN = 64;
+
+// Front for a tree whose load swings between phases of writes and phases of
+// queries.  It counts the reads and writes of each sample of ADAPT_SAMPLE
+// operations: when almost all of them were reads, the values are moved out
+// of the avl_tree into a sorted array, where rank and select are O(log n)
+// and O(1) without chasing pointers; when writes pick up again, they are
+// moved back to nodes.  Writes that reach the array are held in a small
+// sorted run beside it (see sorted_writes), which queries take into
+// account, and merged into it in O(n) once the run holds the square root of
+// its size, so a write costs O(sqrt n) amortised instead of moving half the
+// array.  Both conversions are O(n), through avl_tree::assign and
+// avl_tree::bottomK.
+class adaptive_tree : public tree_front {
+    avl_tree &tree;
+    vector<int> values;     // sorted values, while frozen
+    sorted_writes pending;  // writes not merged into values yet
+    bool frozen;
+    int reads;
+    int writes;
+    node *record(node *, bool);
+    node *freeze(node *);
+    void write(int, bool);
+    void merge();
+public:
+    explicit adaptive_tree(avl_tree &tree)
+            : tree(tree), frozen(false), reads(0), writes(0) {}
+    node *insert(node *, int) override;
+    node *deleteNode(node *, int) override;
+    node *prepareReads(node *, int) override;
+    int numNodesSmallerThan(node *, int) override;
+    int kSmallest(node *, int) override;
+    int getNumElements() override;
+    node *expand(node *) override;
+};
+
+/*
+ * node *adaptive_tree::record(node *, bool)
+ * Private method that counts an operation, a write or a read, in the
+ * current sample.  At the end of a sample, the values change layout if the
+ * mix of operations calls for it.  Returns the root of the tree.
+ */
+node *adaptive_tree::record(node *root, bool write) {
+    if (write) {
+        writes++;
+    } else {
+        reads++;
+    }
+    if (reads + writes < ADAPT_SAMPLE) {
+        return root;
+    }
+    if (!frozen && writes * 100 <= ADAPT_SAMPLE * ADAPT_FREEZE) {
+        root = freeze(root);
+    } else if (frozen && writes * 100 >= ADAPT_SAMPLE * ADAPT_THAW) {
+        root = expand(root);
+    }
+    reads = 0;
+    writes = 0;
+    return root;
+}
+
+/*
+ * node *adaptive_tree::insert(node *, int)
+ * Inserts a value and returns the root.  If the value is already there, the
+ * method does nothing.
+ */
+node *adaptive_tree::insert(node *root, int value) {
+    root = record(root, true);
+    if (!frozen) {
+        return tree.insert(root, value);
+    }
+    write(value, true);
+    return root;
+}
+
+/*
+ * node *adaptive_tree::deleteNode(node *, int)
+ * Deletes a value and returns the root.  If the value is not there, the
+ * method does nothing.
+ */
+node *adaptive_tree::deleteNode(node *root, int value) {
+    root = record(root, true);
+    if (!frozen) {
+        return tree.deleteNode(root, value);
+    }
+    write(value, false);
+    return root;
+}
+
+/*
+ * void adaptive_tree::write(int, bool)
+ * Private method that adds a write making value present or not to the run
+ * beside the array, and merges the run once it is full.
+ */
+void adaptive_tree::write(int value, bool present) {
+    pending.record(value, present, [&](int value) {
+        return binary_search(values.begin(), values.end(), value);
+    });
+    size_t limit = max((size_t) ADAPT_RUN, (size_t) sqrt((double) values.size()));
+    if (pending.keys.size() >= limit) {
+        merge();
+    }
+}
+
+/*
+ * void adaptive_tree::merge()
+ * Private method that applies the run of writes to the array in one pass.
+ */
+void adaptive_tree::merge() {
+    if (pending.keys.empty()) {
+        return;
+    }
+    vector<int> merged;
+    merged.reserve(values.size() + pending.net);
+    size_t next = 0;
+    for (size_t i = 0; i < pending.keys.size(); i++) {
+        int key = pending.keys[i];
+        while (next < values.size() && values[next] < key) {
+            merged.push_back(values[next++]);
         }
-        for (i = 0; (i < level) && (position != root); i++) {
-            cout << " ";
+        if (pending.deltas[i] > 0) {
+            merged.push_back(key);
+        } else {
+            next++;     // the deleted value
         }
-        cout << position->value;
-        show(position->left, level + 1);
     }
+    merged.insert(merged.end(), values.begin() + next, values.end());
+    values.swap(merged);
+    pending.clear();
 }
 
 /*
- * void avl_tree::inorder(node *)
- * Shows the tree inorder traversal.
+ * node *adaptive_tree::prepareReads(node *, int)
+ * Counts a run of reads in the samples, so that the layout is settled
+ * before they run, and returns the root.
  */
-void avl_tree::inorder(node *tree) {
-    if (tree == nullptr) {
-        return;
+node *adaptive_tree::prepareReads(node *root, int count) {
+    for (int i = 0; i < count; i++) {
+        root = record(root, false);
     }
-    inorder(tree->left);
-    cout << tree->value << " ";
-    inorder(tree->right);
+    return root;
 }
 
 /*
- * void avl_tree::preorder(node *)
- * Shows the tree preorder traversal
+ * int adaptive_tree::numNodesSmallerThan(node *, int)
+ * Returns the number of values smaller than x.
  */
-void avl_tree::preorder(node *tree) {
-    if (tree == nullptr) {
-        return;
+int adaptive_tree::numNodesSmallerThan(node *root, int x) {
+    if (!frozen) {
+        return tree.numNodesSmallerThan(root, x);
     }
-    cout << tree->value << " ";
-    preorder(tree->left);
-    preorder(tree->right);
+    return lower_bound(values.begin(), values.end(), x) - values.begin() + pending.below(x);
 }
 
 /*
- * void avl_tree::postorder(node *)
- * Shows the tree postorder traversal
+ * int adaptive_tree::kSmallest(node *, int)
+ * Returns the kth smallest value.  If k is less than 1 or greater than the
+ * number of values, the method raises an exception.
  */
-void avl_tree::postorder(node *tree) {
-    if (tree == nullptr) {
-        return;
+int adaptive_tree::kSmallest(node *root, int k) {
+    if (!frozen) {
+        return tree.kSmallest_v2(root, k);
     }
-    postorder(tree->left);
-    postorder(tree->right);
-    cout << tree->value << " ";
+    if (k < 1 || k > getNumElements()) {
+        throw invalid_argument("impossible value for k");
+    }
+    int found;
+    auto rank = [&](int x) {
+        return lower_bound(values.begin(), values.end(), x) - values.begin();
+    };
+    if (pending.select(k, rank, found)) {
+        return found;
+    }
+    return values[found - 1];
+}
+
+/*
+ * int adaptive_tree::getNumElements()
+ * Returns the number of values.
+ */
+int adaptive_tree::getNumElements() {
+    return frozen ? values.size() + pending.net : tree.getNumElements();
+}
+
+/*
+ * node *adaptive_tree::expand(node *)
+ * Moves the values back to the tree, if they are in the array, and returns
+ * its root.
+ */
+node *adaptive_tree::expand(node *root) {
+    if (frozen) {
+        merge();
+        array_source source = {values.data()};
+        root = tree.assign(root, source, values.size());
+        values.clear();
+        frozen = false;
+    }
+    return root;
+}
+
+/*
+ * node *adaptive_tree::freeze(node *)
+ * Private method that moves the values of the tree to the array, returning
+ * the empty root.
+ */
+node *adaptive_tree::freeze(node *root) {
+    values.resize(tree.getNumElements());
+    tree.bottomK(root, values.size(), values.data());
+    array_source none = {values.data()};
+    root = tree.assign(root, none, 0);
+    frozen = true;
+    return root;
+}
+
+// Buffers the inserts and deletes of a tree, and applies them in batches of
+// up to a given number of values, in order of value.  Only the writes that
+// change the tree are kept, sorted by value (see sorted_writes); a write
+// undoing a buffered one cancels it, so a value inserted and deleted before
+// the batch is applied never reaches the tree.  Every query sees every
+// write made before it, at the cost of a few binary searches over the
+// buffer.
+class write_buffer : public tree_front {
+    avl_tree &tree;
+    sorted_writes writes;
+    size_t capacity;
+public:
+    explicit write_buffer(avl_tree &tree) : tree(tree), capacity(0) {}
+    void resize(int);
+    bool enabled();
+    node *insert(node *, int) override;
+    node *deleteNode(node *, int) override;
+    int numNodesSmallerThan(node *, int) override;
+    int kSmallest(node *, int) override;
+    int getNumElements() override;
+    node *expand(node *) override;
+};
+
+/*
+ * void write_buffer::resize(int)
+ * Changes the number of values buffered before the writes are applied.  A
+ * size of 0 disables the buffer.  The buffer must have been flushed before.
+ */
+void write_buffer::resize(int size) {
+    capacity = max(size, 0);
+}
+
+/*
+ * bool write_buffer::enabled()
+ * Returns true if the buffer has a size.
+ */
+bool write_buffer::enabled() {
+    return capacity > 0;
+}
+
+/*
+ * node *write_buffer::insert(node *, int)
+ * Buffers the insert of a value and returns the root, which only changes
+ * when the buffer fills up and is applied.
+ */
+node *write_buffer::insert(node *root, int value) {
+    writes.record(value, true, [&](int value) { return tree.search(root, value) != nullptr; });
+    return writes.keys.size() >= capacity ? expand(root) : root;
+}
+
+/*
+ * node *write_buffer::deleteNode(node *, int)
+ * Buffers the delete of a value and returns the root, which only changes
+ * when the buffer fills up and is applied.
+ */
+node *write_buffer::deleteNode(node *root, int value) {
+    writes.record(value, false, [&](int value) { return tree.search(root, value) != nullptr; });
+    return writes.keys.size() >= capacity ? expand(root) : root;
+}
+
+/*
+ * int write_buffer::numNodesSmallerThan(node *, int)
+ * Returns the number of values smaller than x, buffered writes included.
+ */
+int write_buffer::numNodesSmallerThan(node *root, int x) {
+    return tree.numNodesSmallerThan(root, x) + writes.below(x);
+}
+
+/*
+ * int write_buffer::kSmallest(node *, int)
+ * Returns the kth smallest value, buffered writes included, in
+ * O(log B * log n) (see sorted_writes::select).  If k is less than 1 or
+ * greater than the number of values, the method raises an exception.
+ */
+int write_buffer::kSmallest(node *root, int k) {
+    if (k < 1 || k > getNumElements()) {
+        throw invalid_argument("impossible value for k");
+    }
+    int found;
+    auto rank = [&](int x) { return tree.numNodesSmallerThan(root, x); };
+    if (writes.select(k, rank, found)) {
+        return found;
+    }
+    return tree.kSmallest_v2(root, found);
+}
+
+/*
+ * int write_buffer::getNumElements()
+ * Returns the number of values, buffered writes included.
+ */
+int write_buffer::getNumElements() {
+    return tree.getNumElements() + writes.net;
+}
+
+/*
+ * node *write_buffer::expand(node *)
+ * Applies the buffered writes to the tree, in order of value, and returns
+ * the new root.  The inserts go through a finger, so each one only climbs
+ * as far as the previous one.
+ */
+node *write_buffer::expand(node *root) {
+    tree_finger finger;
+    for (size_t i = 0; i < writes.keys.size(); i++) {
+        if (writes.deltas[i] > 0) {
+            root = tree.fingerInsert(root, finger, writes.keys[i]);
+        } else {
+            root = tree.deleteNode(root, writes.keys[i]);
+        }
+    }
+    writes.clear();
+    return root;
+}
+
+// Front serving a snapshot without loading it: opening one maps the file
+// and reads only its index (see snapshot_map), so it is O(number of
+// blocks) whatever the number of values.  The values of a block reach the
+// tree only when a write falls within the block's range, or when the whole
+// snapshot is expanded; until then, queries count the block as a whole
+// from its index entry, and decode it in place when they need its values.
+// Pages of the file are faulted in by those accesses only.  The tree holds
+// the loaded blocks and every value written since, none of which can fall
+// within a block that isn't loaded.  A Fenwick tree over the sizes of the
+// blocks not loaded yet gives how many of their values come before any
+// block in O(log blocks).  A block found corrupt when it is decoded never
+// reaches the tree: the front only records the failure, which main reports
+// before dropping the blocks not loaded yet.
+class lazy_snapshot : public tree_front {
+    // Hands out the values of the unloaded blocks merged with those of the
+    // tree, for avl_tree::assign
+    struct merged_values {
+        lazy_snapshot &owner;
+        const int *tree;
+        const int *treeEnd;
+        int block;
+        int values[SNAPSHOT_BLOCK];
+        int position;
+        int count;
+
+        merged_values(lazy_snapshot &owner, const int *tree, const int *treeEnd)
+                : owner(owner), tree(tree), treeEnd(treeEnd), block(0), position(0), count(0) {}
+        int next();
+    };
+
+    avl_tree &tree;
+    snapshot_map snapshot;
+    vector<char> loaded;
+    vector<long> pending;       // Fenwick tree of the sizes of unloaded blocks
+    int unloaded;               // number of values not loaded yet
+    atomic<bool> corrupt;       // a block failed to decode since open
+    long pendingBefore(int);
+    int nextPending(int);
+    int blockAtOrAbove(int);
+    bool decode(int, int *);
+    node *fault(node *, int);
+public:
+    explicit lazy_snapshot(avl_tree &tree) : tree(tree), unloaded(0), corrupt(false) {}
+    node *open(node *, const char *);
+    bool failed();
+    node *drop(node *);
+    node *insert(node *, int) override;
+    node *deleteNode(node *, int) override;
+    int numNodesSmallerThan(node *, int) override;
+    int kSmallest(node *, int) override;
+    int getNumElements() override;
+    node *expand(node *) override;
+};
+
+/*
+ * node *lazy_snapshot::open(node *, const char *)
+ * Replaces every value of the tree with the snapshot stored at path, and
+ * returns the new, empty root.  If the file can't be opened or its index is
+ * invalid, the method raises an exception and the tree keeps its values.
+ */
+node *lazy_snapshot::open(node *root, const char *path) {
+    root = expand(root);
+    snapshot.open(path, MADV_RANDOM);
+    array_source none = {nullptr};
+    root = tree.assign(root, none, 0);
+    loaded.assign(snapshot.blocks, 0);
+    pending.assign(snapshot.blocks + 1, 0);
+    for (int i = 1; i <= snapshot.blocks; i++) {
+        pending[i] += snapshot.index[i - 1].block.count;
+        int parent = i + (i & -i);
+        if (parent <= snapshot.blocks) {
+            pending[parent] += pending[i];
+        }
+    }
+    unloaded = snapshot.count;
+    corrupt = false;
+    return root;
+}
+
+/*
+ * bool lazy_snapshot::failed()
+ * Returns true if a block of the snapshot has turned out to be corrupt.
+ * The values answered and loaded since are then unreliable, until drop.
+ */
+bool lazy_snapshot::failed() {
+    return corrupt;
 }
 
+/*
+ * node *lazy_snapshot::drop(node *)
+ * Gives up on a corrupt snapshot: the tree keeps the values loaded from it
+ * and written since, the other blocks are discarded, and the snapshot is
+ * unmapped.  Returns the root.
+ */
+node *lazy_snapshot::drop(node *root) {
+    corrupt = true;
+    root = expand(root);
+    corrupt = false;
+    return root;
+}
+
+/*
+ * long lazy_snapshot::pendingBefore(int)
+ * Private method that returns the number of values in the unloaded blocks
+ * before the given one.
+ */
+long lazy_snapshot::pendingBefore(int block) {
+    long sum = 0;
+    for (int i = block; i > 0; i -= i & -i) {
+        sum += pending[i];
+    }
+    return sum;
+}
+
+/*
+ * int lazy_snapshot::nextPending(int)
+ * Private method that returns the first unloaded block from the given one
+ * on, or the number of blocks if there is none, by walking down the
+ * Fenwick tree.
+ */
+int lazy_snapshot::nextPending(int block) {
+    long target = pendingBefore(block) + 1;
+    int found = 0;
+    int step = 1;
+    while (step * 2 <= snapshot.blocks) {
+        step *= 2;
+    }
+    for (; step > 0; step /= 2) {
+        if (found + step <= snapshot.blocks && pending[found + step] < target) {
+            found += step;
+            target -= pending[found];
+        }
+    }
+    return found;
+}
+
+/*
+ * int lazy_snapshot::blockAtOrAbove(int)
+ * Private method that returns the first block whose max is not smaller
+ * than value, or the number of blocks if there is none.
+ */
+int lazy_snapshot::blockAtOrAbove(int value) {
+    const snapshot_entry *at = lower_bound(snapshot.index, snapshot.index + snapshot.blocks,
+                                           value, [](const snapshot_entry &entry, int value) {
+                                               return entry.block.max < value;
+                                           });
+    return at - snapshot.index;
+}
+
+/*
+ * bool lazy_snapshot::decode(int, int *)
+ * Private method that decodes the values of a block into out.  If the
+ * block turns out to be corrupt, the method records it (see failed) and
+ * returns false.  It may be called by concurrent queries.
+ */
+bool lazy_snapshot::decode(int block, int *out) {
+    if (!snapshot.decode(block, out)) {
+        corrupt = true;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * node *lazy_snapshot::fault(node *, int)
+ * Private method that loads a block into the tree, if it isn't there yet,
+ * and returns the root.  Its values are consecutive, so they are inserted
+ * through a finger.  A corrupt block is left out.
+ */
+node *lazy_snapshot::fault(node *root, int block) {
+    if (block == snapshot.blocks || loaded[block]) {
+        return root;
+    }
+    int values[SNAPSHOT_BLOCK];
+    int count = snapshot.index[block].block.count;
+    if (!decode(block, values)) {
+        return root;
+    }
+    tree_finger finger;
+    for (int i = 0; i < count; i++) {
+        root = tree.fingerInsert(root, finger, values[i]);
+    }
+    loaded[block] = 1;
+    for (int i = block + 1; i <= snapshot.blocks; i += i & -i) {
+        pending[i] -= count;
+    }
+    unloaded -= count;
+    return root;
+}
+
+/*
+ * node *lazy_snapshot::insert(node *, int)
+ * Inserts a value, loading first the block whose range it falls within, if
+ * any, and returns the root.
+ */
+node *lazy_snapshot::insert(node *root, int value) {
+    int block = blockAtOrAbove(value);
+    if (block < snapshot.blocks && snapshot.index[block].block.min <= value) {
+        root = fault(root, block);
+    }
+    return tree.insert(root, value);
+}
+
+/*
+ * node *lazy_snapshot::deleteNode(node *, int)
+ * Deletes a value, loading first the block whose range it falls within, if
+ * any, and returns the root.
+ */
+node *lazy_snapshot::deleteNode(node *root, int value) {
+    int block = blockAtOrAbove(value);
+    if (block < snapshot.blocks && snapshot.index[block].block.min <= value) {
+        root = fault(root, block);
+    }
+    return tree.deleteNode(root, value);
+}
+
+/*
+ * int lazy_snapshot::numNodesSmallerThan(node *, int)
+ * Returns the number of values smaller than x.  The unloaded blocks below
+ * x count as a whole; only the one x falls within, if any, is decoded.
+ */
+int lazy_snapshot::numNodesSmallerThan(node *root, int x) {
+    int block = blockAtOrAbove(x);
+    long smaller = tree.numNodesSmallerThan(root, x) + pendingBefore(block);
+    if (block < snapshot.blocks && !loaded[block] && snapshot.index[block].block.min < x) {
+        int values[SNAPSHOT_BLOCK];
+        if (!decode(block, values)) {
+            return smaller;
+        }
+        smaller += lower_bound(values, values + snapshot.index[block].block.count, x) - values;
+    }
+    return smaller;
+}
+
+/*
+ * int lazy_snapshot::kSmallest(node *, int)
+ * Returns the kth smallest value.  A binary search over the index finds the
+ * first unloaded block reaching the kth value, if any; the value is then
+ * picked among the tree and that block's values with
+ * avl_tree::selectMerged, every unloaded block before it counting as a
+ * whole.  If k is less than 1 or greater than the number of values, the
+ * method raises an exception.
+ */
+int lazy_snapshot::kSmallest(node *root, int k) {
+    if (k < 1 || k > getNumElements()) {
+        throw invalid_argument("impossible value for k");
+    }
+    // First block such that the values up to its max are at least k
+    int low = 0;
+    int high = snapshot.blocks;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        int max = snapshot.index[middle].block.max;
+        if (tree.numNodesSmallerThan(root, max) + pendingBefore(middle + 1) >= k) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    int block = nextPending(low);
+    if (block == snapshot.blocks) {
+        return tree.kSmallest_v2(root, k - unloaded);
+    }
+    int values[SNAPSHOT_BLOCK];
+    int ones[SNAPSHOT_BLOCK];
+    int count = snapshot.index[block].block.count;
+    if (!decode(block, values)) {
+        return snapshot.index[block].block.min;
+    }
+    fill(ones, ones + count, 1);
+    return tree.selectMerged(root, values, ones, count, k - pendingBefore(block));
+}
+
+/*
+ * int lazy_snapshot::getNumElements()
+ * Returns the number of values, loaded or not.
+ */
+int lazy_snapshot::getNumElements() {
+    return tree.getNumElements() + unloaded;
+}
+
+/*
+ * int lazy_snapshot::merged_values::next()
+ * Returns the next value, from the tree or from the next unloaded block,
+ * decoding the blocks one at a time as they are reached.  The values of a
+ * corrupt block are handed out all the same, for expand to throw away.
+ */
+int lazy_snapshot::merged_values::next() {
+    while (position == count && block < owner.snapshot.blocks
+            && (tree == treeEnd || owner.snapshot.index[block].block.min < *tree)) {
+        if (!owner.loaded[block]) {
+            owner.decode(block, values);
+            position = 0;
+            count = owner.snapshot.index[block].block.count;
+        }
+        block++;
+    }
+    if (position < count && (tree == treeEnd || values[position] < *tree)) {
+        return values[position++];
+    }
+    return *tree++;
+}
+
+/*
+ * node *lazy_snapshot::expand(node *)
+ * Loads every block not loaded yet, rebuilding the tree in O(n) from its
+ * values merged with theirs, unmaps the snapshot and returns the new root.
+ * The blocks are decoded straight into the new nodes.  If one of them
+ * turns out to be corrupt, or one already did, the tree is left with its
+ * own values only, and failed stays true.
+ */
+node *lazy_snapshot::expand(node *root) {
+    if (snapshot.data == nullptr) {
+        return root;
+    }
+    if (unloaded > 0 && !corrupt) {
+        vector<int> inTree(tree.getNumElements());
+        tree.bottomK(root, inTree.size(), inTree.data());
+        merged_values values(*this, inTree.data(), inTree.data() + inTree.size());
+        root = tree.assign(root, values, getNumElements());
+        if (corrupt) {
+            array_source own = {inTree.data()};
+            root = tree.assign(root, own, inTree.size());
+        }
+    }
+    snapshot.close();
+    loaded.clear();
+    pending.clear();
+    unloaded = 0;
+    return root;
+}
+
+// Shortest run of queries in main that is split across threads; shorter ones
+// don't pay for starting them
+const size_t PARALLEL_READS = 1024;
+
+// Longest run of queries main holds back, per thread, in units of
+// PARALLEL_READS.  The tree doesn't change within a run, so answering a
+// long one in pieces prints the same, while keeping memory bounded and the
+// answers flowing.
+const size_t HELD_READS = 16;
+
 int main() {
     int Q;
     avl_tree tree;
+    small_tree small(tree);
+    adaptive_tree adaptive(tree);
+    bool adapting = false;
+    write_buffer buffer(tree);
+    lazy_snapshot snapshot(tree);
+    tree_front *front = &small;
+    sliding_window window(tree);
+    timer_wheel wheel;
+    long ttl = 0;
+
+    // Picks the front for the modes set by A and B; an adaptive tree takes
+    // precedence over the write buffer
+    auto pick = [&]() -> tree_front * {
+        if (adapting) {
+            return &adaptive;
+        } else if (buffer.enabled()) {
+            return &buffer;
+        }
+        return &small;
+    };
+
+    // Answers a C or K query, returning false if it is invalid.  It only
+    // reads the tree, so queries can run concurrently.
+    auto ask = [&](char option, int n, int &result) {
+        if (option == 'C') {
+            result = front->numNodesSmallerThan(root, n);
+            return true;
+        } else if (n < 1 || n > front->getNumElements()) {
+            return false;
+        }
+        result = front->kSmallest(root, n);
+        return true;
+    };
+
+    // Reports a lazily served snapshot found to be corrupt, and drops the
+    // blocks of it not loaded yet.  Returns true if it did.
+    auto checkSnapshot = [&]() {
+        if (!snapshot.failed()) {
+            return false;
+        }
+        cout << "load failed" << endl;
+        root = snapshot.drop(root);
+        if (front == &snapshot) {
+            front = pick();
+        }
+        return true;
+    };
+
+    // Queries are held back until the next write, or the end of the input.
+    // The whole run sees the same tree, so long runs are split across
+    // threads, and the answers printed in order afterwards.
+    vector<pair<char, int>> reads;
+    size_t heldReads = HELD_READS * PARALLEL_READS * max(1u, thread::hardware_concurrency());
+    vector<int> results;
+    vector<char> valid;
+    auto runReads = [&]() {
+        // A window keeps every value in the tree already (see below)
+        if (!window.enabled()) {
+            root = front->prepareReads(root, reads.size());
+        }
+        results.assign(reads.size(), 0);
+        valid.assign(reads.size(), 0);
+        auto work = [&](size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                valid[i] = ask(reads[i].first, reads[i].second, results[i]);
+            }
+        };
+        size_t threads = 1;
+        if (reads.size() >= PARALLEL_READS) {
+            threads = max(1u, thread::hardware_concurrency());
+        }
+        size_t chunk = (reads.size() + threads - 1) / threads;
+        vector<thread> pool;
+        for (size_t i = 1; i < threads; i++) {
+            pool.emplace_back(work, min(i * chunk, reads.size()),
+                              min((i + 1) * chunk, reads.size()));
+        }
+        work(0, min(chunk, reads.size()));
+        for (thread &worker : pool) {
+            worker.join();
+        }
+    };
+    auto answerReads = [&]() {
+        runReads();
+        // Answers that reached a corrupt block are thrown away, and the run
+        // answered again without it
+        if (checkSnapshot()) {
+            runReads();
+        }
+        for (size_t i = 0; i < reads.size(); i++) {
+            if (valid[i]) {
+                cout << results[i] << '\n';
+            } else {
+                cout << "invalid" << '\n';
+            }
+        }
+        cout.flush();
+        reads.clear();
+    };
+
     cin >> Q;
     while (Q--) {
         char option;
         int n;
         cin >> option >> n;
+        if (option == 'C' || option == 'K') {
+            reads.push_back({option, n});
+            if (reads.size() >= heldReads) {
+                answerReads();
+            }
+            continue;
+        }
+        answerReads();
+        // Only I and D, besides the queries, go through the front; anything
+        // else, and a window, needs every value in the tree
+        if (window.enabled() || strchr("IDT", option) == nullptr) {
+            root = front->expand(root);
+            front = pick();
+            checkSnapshot();
+        }
         switch(option){
             case 'I':
-                root = tree.insert(root, n);
+                if (ttl > 0) {
+                    wheel.schedule(n, ttl);
+                } else {
+                    wheel.cancel(n);
+                }
+                if (window.enabled()) {
+                    root = window.insert(root, n);
+                    break;
+                }
+                root = front->insert(root, n);
                 //tree.inorder(root);
                 //cout << endl;
                 break;
             case 'D':
-                root = tree.deleteNode(root, n);
+                wheel.cancel(n);
+                if (window.enabled()) {
+                    root = window.deleteNode(root, n);
+                    break;
+                }
+                root = front->deleteNode(root, n);
                 //tree.inorder(root);
                 //cout << endl;
                 break;
-            case 'C':
-                cout << tree.numNodesSmallerThan(root, n) << endl;
+            case 'S': {
+                string path = "snapshot_" + to_string(n) + ".bin";
+                if (tree.checkpoint(root, path.c_str()) < 0) {
+                    cout << "checkpoint failed" << endl;
+                }
                 break;
-            case 'K':
-                if (n < 1 || n > tree.getNumElements()) {
+            }
+            case 'P':
+                if (n < 0 || n > 1000 || tree.getNumElements() == 0) {
                     cout << "invalid" << endl;
                 } else {
-                    cout << tree.kSmallest_v2(root, n) << endl;
+                    cout << tree.percentile(tree.trackPercentile(root, n)) << endl;
+                }
+                break;
+            case 'R':
+                root = tree.compact(root, n);
+                break;
+            case 'T':
+                ttl = n;
+                break;
+            case 'X': {
+                vector<int> expired;
+                wheel.advance(n, expired);
+                if (window.enabled()) {
+                    for (int key : expired) {
+                        root = window.deleteNode(root, key);
+                    }
+                } else {
+                    root = tree.deleteBatch(root, expired.data(), expired.size());
+                }
+                break;
+            }
+            case 'E': {
+                int hi;
+                cin >> hi;
+                if (window.enabled()) {
+                    root = window.eraseRange(root, n, hi);
+                } else {
+                    root = tree.eraseRange(root, n, hi);
+                }
+                break;
+            }
+            case 'Z':
+                root = tree.setLazyDelete(root, n);
+                break;
+            case 'A':
+                adapting = n > 0;
+                front = pick();
+                break;
+            case 'B':
+                buffer.resize(n);
+                front = pick();
+                break;
+            case 'W':
+                window.resize(n);
+                break;
+            case 'L': {
+                string path = "snapshot_" + to_string(n) + ".bin";
+                // The snapshot may still be being written by a checkpoint
+                tree.awaitCheckpoint(path.c_str());
+                try {
+                    // Without a window or another front, the snapshot is
+                    // served lazily, until the next operation other than
+                    // I, D, T and the queries
+                    if (front == &small && !window.enabled()) {
+                        root = snapshot.open(root, path.c_str());
+                        front = &snapshot;
+                    } else {
+                        root = tree.load(root, path.c_str());
+                    }
+                    window.clear();
+                    // The deadlines were set on the keys of the old tree
+                    wheel.clear();
+                } catch (const runtime_error &) {
+                    cout << "load failed" << endl;
                 }
                 break;
+            }
             default:
                 break;
         }
+        checkSnapshot();
+        tree.reapCheckpoints(false);
+    }
+    answerReads();
+    if (tree.reapCheckpoints(true) > 0) {
+        cout << "checkpoint failed" << endl;
     }
     return 0;
 }